@@ -4,11 +4,20 @@
 
 #include <nan.h>
 
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <filesystem>
 #include <iostream>
 #include <map>
 #include <memory>
+#include <mutex>
 #include <queue>
+#include <set>
+#include <span>
 #include <thread>
+#include <utility>
+#include <variant>
 
 using Nan::AsyncProgressQueueWorker;
 using Nan::AsyncQueueWorker;
@@ -31,116 +40,525 @@ using v8::Value;
 
 using namespace graphql;
 
-static std::shared_ptr<today::Appointment> appointment;
-static std::shared_ptr<today::Task> task;
-static std::shared_ptr<today::Folder> folder;
+// Replaced by each call to startService, the entities are row views into it. The dataset option
+// of startService maps it from a file, which is shared by every process that opens it.
+static std::shared_ptr<today::EntityStore> store;
 
-static std::map<response::IdType, std::shared_ptr<today::object::Node>> nodes;
+// Feeds the DeliveryPipeline with every update to the store.
+static std::shared_ptr<today::ChangeLog> changeLog;
+
+// Persists completeTask when startService has a dataset.
+static std::shared_ptr<today::Journal> journal;
 
 static std::shared_ptr<today::Operations> serviceSingleton;
 
-void loadAppointments()
+// Each request gets its own today::RequestState, e.g. for the BatchLoader.
+static std::atomic<size_t> requestId = 0;
+
+// Set by the globalIds option of startService.
+static bool useGlobalIds = false;
+
+// Set by the requestStats option of startService, which adds the RequestState counters to the
+// extensions of each query and mutation response.
+static bool reportRequestStats = false;
+
+response::IdType makeId(today::NodeType type, std::string_view fakeId)
 {
-	std::string fakeAppointmentId("fakeAppointmentId");
-	response::IdType binAppointmentId(fakeAppointmentId.size());
-	std::copy(fakeAppointmentId.cbegin(), fakeAppointmentId.cend(), binAppointmentId.begin());
+	response::IdType binId(fakeId.size());
+	std::copy(fakeId.cbegin(), fakeId.cend(), binId.begin());
 
-	appointment = std::make_shared<today::Appointment>(std::move(binAppointmentId),
+	return useGlobalIds ? today::GlobalId::encode(type, binId) : binId;
+}
+
+void loadAppointments()
+{
+	store->addAppointment(makeId(today::NodeType::Appointment, "fakeAppointmentId"),
 		"tomorrow",
 		"Lunch?",
 		false);
-
-	nodes[appointment->id()] = std::make_shared<today::object::Node>(
-		std::make_shared<today::object::Appointment>(appointment));
-};
+}
 
 void loadTasks()
 {
-	std::string fakeTaskId("fakeTaskId");
-	response::IdType binTaskId(fakeTaskId.size());
-	std::copy(fakeTaskId.cbegin(), fakeTaskId.cend(), binTaskId.begin());
-
-	task = std::make_shared<today::Task>(std::move(binTaskId), "Don't forget", true);
-
-	nodes[task->id()] =
-		std::make_shared<today::object::Node>(std::make_shared<today::object::Task>(task));
+	store->addTask(makeId(today::NodeType::Task, "fakeTaskId"), "Don't forget", true);
 }
 
 void loadUnreadCounts()
 {
-	std::string fakeFolderId("fakeFolderId");
-	response::IdType binFolderId(fakeFolderId.size());
-	std::copy(fakeFolderId.cbegin(), fakeFolderId.cend(), binFolderId.begin());
+	store->addFolder(makeId(today::NodeType::Folder, "fakeFolderId"), "\"Fake\" Inbox", 3);
+}
+
+// Open the dataset if it exists, otherwise build the fake data and write it to the dataset. Either
+// way the journal next to it replays any later mutations.
+void loadStore(const std::string& dataset, size_t compactAfter)
+{
+	std::error_code ec;
+
+	if (!dataset.empty() && std::filesystem::exists(dataset, ec))
+	{
+		store = today::EntityStore::load(dataset);
+	}
+	else
+	{
+		store = std::make_shared<today::EntityStore>();
+		loadAppointments();
+		loadTasks();
+		loadUnreadCounts();
+
+		if (!dataset.empty())
+		{
+			store->save(dataset);
+		}
+	}
 
-	folder = std::make_shared<today::Folder>(std::move(binFolderId), "\"Fake\" Inbox", 3);
+	if (!dataset.empty())
+	{
+		journal = std::make_shared<today::Journal>(store, dataset, compactAfter);
+	}
 
-	nodes[folder->id()] =
-		std::make_shared<today::object::Node>(std::make_shared<today::object::Folder>(folder));
+	// Updates replayed from the journal are not delivered to anyone.
+	changeLog = std::make_shared<today::ChangeLog>();
+	store->captureChanges(changeLog);
 }
 
-class MockSubscription
+// Each subscription collects the fields and arguments it is listening to while it registers.
+struct SubscriptionState : today::RequestState
+{
+	using today::RequestState::RequestState;
+
+	std::mutex mutex;
+	std::vector<std::pair<std::string, std::string>> routes;
+};
+
+// Subscription root when a subscription registers. It never resolves a payload, it only records
+// the nodeChange id or nextAppointmentChange in the SubscriptionState for the SubscriptionRouter.
+class RoutingSubscription
+{
+public:
+	explicit RoutingSubscription() = default;
+
+	std::shared_ptr<today::object::Appointment> getNextAppointmentChange(
+		service::FieldParams&& params) const
+	{
+		addRoute(params, "nextAppointmentChange", {});
+		return nullptr;
+	}
+
+	std::shared_ptr<today::object::Node> getNodeChange(
+		service::FieldParams&& params, response::IdType&& idArg) const
+	{
+		addRoute(params, "nodeChange", today::GlobalId::key(idArg));
+		return nullptr;
+	}
+
+private:
+	static void addRoute(
+		const service::FieldParams& params, std::string_view field, std::string_view argumentKey)
+	{
+		if (params.resolverContext != service::ResolverContext::NotifySubscribe)
+		{
+			return;
+		}
+
+		if (auto state = std::dynamic_pointer_cast<SubscriptionState>(params.state))
+		{
+			std::lock_guard lock(state->mutex);
+
+			state->routes.emplace_back(field, argumentKey);
+		}
+	}
+};
+
+// Routing table from the subscription field and its argument key (e.g. the GlobalId::key of the
+// nodeChange id) to the subscriptions listening to it, so each event is only delivered to the
+// subscriptions which match it instead of filtering every subscription.
+class SubscriptionRouter
 {
 public:
-	explicit MockSubscription() = default;
+	using Route = std::pair<std::string, std::string>;
+
+	void add(service::SubscriptionKey key, std::shared_ptr<SubscriptionState> state,
+		std::vector<Route>&& routes)
+	{
+		std::lock_guard lock(_mutex);
+
+		for (const auto& [field, argumentKey] : routes)
+		{
+			_routes[field][argumentKey].insert(key);
+		}
+
+		_keys[key] = { std::move(routes), std::move(state) };
+	}
+
+	void remove(service::SubscriptionKey key)
+	{
+		std::lock_guard lock(_mutex);
+		auto itrKey = _keys.find(key);
+
+		if (itrKey == _keys.end())
+		{
+			return;
+		}
+
+		for (const auto& [field, argumentKey] : itrKey->second.routes)
+		{
+			auto itrField = _routes.find(field);
+
+			if (itrField == _routes.end())
+			{
+				continue;
+			}
+
+			auto itrArgument = itrField->second.find(argumentKey);
+
+			if (itrArgument != itrField->second.end())
+			{
+				itrArgument->second.erase(key);
+
+				if (itrArgument->second.empty())
+				{
+					itrField->second.erase(itrArgument);
+				}
+			}
+
+			if (itrField->second.empty())
+			{
+				_routes.erase(itrField);
+			}
+		}
+
+		_keys.erase(itrKey);
+	}
+
+	using Match = std::pair<service::SubscriptionKey, std::shared_ptr<SubscriptionState>>;
+
+	std::vector<Match> find(std::string_view field, std::string_view argumentKey) const
+	{
+		std::lock_guard lock(_mutex);
+		auto itrField = _routes.find(field);
+
+		if (itrField == _routes.end())
+		{
+			return {};
+		}
+
+		auto itrArgument = itrField->second.find(argumentKey);
+
+		if (itrArgument == itrField->second.end())
+		{
+			return {};
+		}
+
+		std::vector<Match> matches;
+
+		matches.reserve(itrArgument->second.size());
+
+		for (const auto key : itrArgument->second)
+		{
+			matches.emplace_back(key, _keys.at(key).state);
+		}
+
+		return matches;
+	}
+
+	void clear()
+	{
+		std::lock_guard lock(_mutex);
+
+		_routes.clear();
+		_keys.clear();
+	}
+
+private:
+	struct Registration
+	{
+		std::vector<Route> routes;
+		std::shared_ptr<SubscriptionState> state;
+	};
+
+	mutable std::mutex _mutex;
+	std::map<std::string,
+		std::map<std::string, std::set<service::SubscriptionKey>, std::less<>>,
+		std::less<>>
+		_routes;
+	std::map<service::SubscriptionKey, Registration> _keys;
+};
+
+static SubscriptionRouter router;
 
-	std::shared_ptr<today::object::Appointment> getNextAppointmentChange() const
+// Subscription root for a single ChangeEvent. The changed node is resolved once and shared by
+// every subscriber, and the SubscriptionRouter already matched the nodeChange id.
+class ChangeSubscription
+{
+public:
+	explicit ChangeSubscription(std::shared_ptr<today::object::Node> node,
+		std::shared_ptr<today::object::Appointment> appointment)
+		: _node(std::move(node))
+		, _appointment(std::move(appointment))
 	{
-		throw std::runtime_error("Unexpected call to getNextAppointmentChange");
 	}
 
-	std::shared_ptr<today::object::Node> getNodeChange(response::IdType&& nodeId) const
+	std::shared_ptr<today::object::Appointment> getNextAppointmentChange() const noexcept
 	{
-		auto itr = nodes.find(nodeId);
+		return _appointment;
+	}
 
-		return itr == nodes.end() ? std::shared_ptr<today::object::Node> {} : itr->second;
+	std::shared_ptr<today::object::Node> getNodeChange(response::IdType&&) const noexcept
+	{
+		return _node;
 	}
+
+private:
+	const std::shared_ptr<today::object::Node> _node;
+	const std::shared_ptr<today::object::Appointment> _appointment;
 };
 
+// Fans the ChangeLog out to the subscriptions on its own thread, so the mutations don't wait for
+// every subscriber to resolve. Events are delivered one at a time in sequence order, which keeps
+// them in order for each subscriber.
+class DeliveryPipeline
+{
+public:
+	explicit DeliveryPipeline(std::shared_ptr<today::Operations> service,
+		std::shared_ptr<today::Query> query, std::shared_ptr<today::ChangeLog> changeLog)
+		: _service(std::move(service))
+		, _query(std::move(query))
+		, _changeLog(std::move(changeLog))
+		, _worker([this]() {
+			deliver();
+		})
+	{
+	}
+
+	// Deliver whatever is still in the log before stopping.
+	~DeliveryPipeline()
+	{
+		_changeLog->close();
+		_worker.join();
+	}
+
+private:
+	void deliver()
+	{
+		for (auto events = _changeLog->consume(); !events.empty(); events = _changeLog->consume())
+		{
+			for (const auto& event : events)
+			{
+				try
+				{
+					deliver(event);
+				}
+				catch (const std::exception& ex)
+				{
+					std::cerr << "Caught exception delivering change " << event.sequence << ": "
+							  << ex.what() << std::endl;
+				}
+			}
+		}
+	}
+
+	void deliver(const today::ChangeEvent& event)
+	{
+		std::shared_ptr<today::object::Node> node;
+		std::shared_ptr<today::object::Appointment> appointment;
+		std::span<const std::uint8_t> id;
+
+		if (const auto changed = std::get_if<std::shared_ptr<today::Appointment>>(&event.entity))
+		{
+			id = (*changed)->id();
+			appointment = _query->wrap(*changed);
+			node = std::make_shared<today::object::Node>(appointment);
+		}
+		else if (const auto changed = std::get_if<std::shared_ptr<today::Task>>(&event.entity))
+		{
+			id = (*changed)->id();
+			node = std::make_shared<today::object::Node>(_query->wrap(*changed));
+		}
+		else if (const auto changed = std::get_if<std::shared_ptr<today::Folder>>(&event.entity))
+		{
+			id = (*changed)->id();
+			node = std::make_shared<today::object::Node>(_query->wrap(*changed));
+		}
+		else
+		{
+			return;
+		}
+
+		auto subscriptionObject = std::make_shared<today::object::Subscription>(
+			std::make_shared<ChangeSubscription>(std::move(node), appointment));
+		// Start every delivery before waiting on any of them, and finish this event before the
+		// next one.
+		std::vector<service::AwaitableDeliver> deliveries;
+		const auto deliverTo = [&](std::string_view field, std::string_view argumentKey) {
+			for (const auto& [key, state] : router.find(field, argumentKey))
+			{
+				// Resolve the task as of this event, not whatever the latest update is by then.
+				// Only this thread delivers, so nothing else is reading the pinned version.
+				if (event.taskVersion && state)
+				{
+					state->taskVersion.store(event.taskVersion);
+				}
+
+				deliveries.push_back(_service->deliver({ field,
+					{ service::SubscriptionKey { key } },
+					std::launch::async,
+					subscriptionObject }));
+			}
+		};
+
+		deliverTo("nodeChange", today::GlobalId::key(id));
+
+		if (appointment)
+		{
+			deliverTo("nextAppointmentChange", {});
+		}
+
+		for (auto& delivery : deliveries)
+		{
+			delivery.get();
+		}
+	}
+
+	const std::shared_ptr<today::Operations> _service;
+	const std::shared_ptr<today::Query> _query;
+	const std::shared_ptr<today::ChangeLog> _changeLog;
+
+	std::thread _worker;
+};
+
+static std::unique_ptr<DeliveryPipeline> deliveryPipeline;
+
+// Unsubscribes everything and releases the current service, if there is one.
+void teardownService();
+
 NAN_METHOD(startService)
 {
-	loadAppointments();
-	loadTasks();
-	loadUnreadCounts();
+	// Starting again without stopping must not leave routes or shared subscriptions behind which
+	// point at the old service.
+	teardownService();
+
+	useGlobalIds = false;
+	reportRequestStats = false;
+
+	std::string dataset;
+	size_t compactAfter = today::Journal::defaultCompactAfter;
+	bool usePageLoaders = false;
+
+	if (info.Length() > 0 && info[0]->IsObject())
+	{
+		auto options = To<v8::Object>(info[0]).ToLocalChecked();
+		auto globalIds = Nan::Get(options, New("globalIds").ToLocalChecked());
+		auto datasetPath = Nan::Get(options, New("dataset").ToLocalChecked());
+		auto compactAfterRecords = Nan::Get(options, New("compactAfter").ToLocalChecked());
+		auto pageLoaders = Nan::Get(options, New("pageLoaders").ToLocalChecked());
+		auto requestStats = Nan::Get(options, New("requestStats").ToLocalChecked());
+
+		useGlobalIds =
+			!globalIds.IsEmpty() && To<bool>(globalIds.ToLocalChecked()).FromMaybe(false);
+
+		if (!datasetPath.IsEmpty() && datasetPath.ToLocalChecked()->IsString())
+		{
+			dataset = *Nan::Utf8String(datasetPath.ToLocalChecked());
+		}
+
+		if (!compactAfterRecords.IsEmpty() && compactAfterRecords.ToLocalChecked()->IsNumber())
+		{
+			compactAfter = std::max<std::uint32_t>(1,
+				To<std::uint32_t>(compactAfterRecords.ToLocalChecked()).FromMaybe(1));
+		}
+
+		usePageLoaders =
+			!pageLoaders.IsEmpty() && To<bool>(pageLoaders.ToLocalChecked()).FromMaybe(false);
+		reportRequestStats =
+			!requestStats.IsEmpty() && To<bool>(requestStats.ToLocalChecked()).FromMaybe(false);
+	}
+
+	journal.reset();
+
+	try
+	{
+		loadStore(dataset, compactAfter);
+	}
+	catch (const std::exception& ex)
+	{
+		Nan::ThrowError(ex.what());
+		return;
+	}
+
+	today::Query::PageLoaders pageLoaders;
+
+	if (usePageLoaders)
+	{
+		pageLoaders.appointments = [spStore = store](const today::PageWindow& window,
+									   const today::FieldMask& fields) {
+			return spStore->appointmentPage(window, fields);
+		};
+		pageLoaders.tasks = [spStore = store](const today::PageWindow& window,
+								const today::FieldMask& fields) {
+			return spStore->taskPage(window, fields);
+		};
+		pageLoaders.unreadCounts = [spStore = store](const today::PageWindow& window,
+									   const today::FieldMask& fields) {
+			return spStore->folderPage(window, fields);
+		};
+	}
 
+	// The row views read every column straight from the store, so each load has all of the fields.
 	auto query = std::make_shared<today::Query>(
-		[]() -> std::vector<std::shared_ptr<today::Appointment>> {
-			return { appointment };
+		[spStore = store](today::FieldMask& fields,
+			today::IdOrder& order) -> std::vector<std::shared_ptr<today::Appointment>> {
+			fields = {};
+			order = spStore->appointmentOrder();
+			return spStore->appointments();
 		},
-		[]() -> std::vector<std::shared_ptr<today::Task>> {
-			return { task };
+		[spStore = store](today::FieldMask& fields,
+			today::IdOrder& order) -> std::vector<std::shared_ptr<today::Task>> {
+			fields = {};
+			order = spStore->taskOrder();
+			return spStore->tasks();
 		},
-		[]() -> std::vector<std::shared_ptr<today::Folder>> {
-			return { folder };
-		});
+		[spStore = store](today::FieldMask& fields,
+			today::IdOrder& order) -> std::vector<std::shared_ptr<today::Folder>> {
+			fields = {};
+			order = spStore->folderOrder();
+			return spStore->folders();
+		},
+		std::move(pageLoaders));
 	auto mutation = std::make_shared<today::Mutation>(
-		[](today::CompleteTaskInput&& input) -> std::shared_ptr<today::CompleteTaskPayload> {
-			auto itr = nodes.find(input.id);
+		[spStore = store, spJournal = journal, spQuery = query](today::CompleteTaskInput&& input,
+			const std::shared_ptr<service::RequestState>&)
+			-> std::shared_ptr<today::CompleteTaskPayload> {
+			auto completedTask = spStore->task(input.id);
 
-			if (itr == nodes.end())
+			if (!completedTask)
 			{
-				return nullptr;
+				throw service::schema_exception { { service::schema_error { "task not found" } } };
 			}
 
-			service::SubscriptionArguments arguments;
-
-			arguments["id"] = response::Value(std::move(input.id));
-			serviceSingleton
-				->deliver({ "nodeChange",
-					{ service::SubscriptionFilter { { std::move(arguments) } } },
-					std::launch::async,
-					std::make_shared<today::object::Subscription>(
-						std::make_shared<MockSubscription>()) })
-				.get();
+			// With a journal the update is only applied once it's durable, in journal order, and
+			// the mutation resumes when the writer sets the result.
+			auto written = spJournal
+				? spJournal->append({ input.id, input.isComplete, input.testTaskState })
+				: today::Eventual<std::shared_ptr<const today::TaskVersion>> { spStore->updateTask(
+					input.id, input.isComplete, input.testTaskState) };
 
-			return std::make_shared<today::CompleteTaskPayload>(task,
+			return std::make_shared<today::CompleteTaskPayload>(spQuery->wrap(completedTask),
+				std::move(written),
 				std::move(input.clientMutationId));
 		});
 
-	serviceSingleton = std::make_shared<today::Operations>(std::move(query),
+	serviceSingleton = std::make_shared<today::Operations>(query,
 		std::move(mutation),
-		std::shared_ptr<today::Subscription> {});
+		std::make_shared<RoutingSubscription>());
+	deliveryPipeline = std::make_unique<DeliveryPipeline>(serviceSingleton, query, changeLog);
 }
 
+// Payloads shared by identical subscriptions are serialized once, and every sink gets the same
+// immutable buffer.
+using SharedPayload = std::shared_ptr<const std::string>;
+
+class SharedSubscription;
+
 struct SubscriptionPayloadQueue : std::enable_shared_from_this<SubscriptionPayloadQueue>
 {
 	~SubscriptionPayloadQueue()
@@ -148,7 +566,7 @@ struct SubscriptionPayloadQueue : std::enable_shared_from_this<SubscriptionPaylo
 		Unsubscribe();
 	}
 
-	void Unsubscribe()
+	void Push(SharedPayload payload)
 	{
 		std::unique_lock<std::mutex> lock(mutex);
 
@@ -157,44 +575,228 @@ struct SubscriptionPayloadQueue : std::enable_shared_from_this<SubscriptionPaylo
 			return;
 		}
 
-		registered = false;
-
-		auto deferUnsubscribe = std::move(key);
+		payloads.push(std::move(payload));
 
 		lock.unlock();
 		condition.notify_one();
-
-		if (deferUnsubscribe && serviceSingleton)
-		{
-			serviceSingleton->unsubscribe({ *deferUnsubscribe }).get();
-		}
 	}
 
+	void Unsubscribe();
+
 	std::mutex mutex;
 	std::condition_variable condition;
-	std::queue<response::AwaitableValue> payloads;
-	std::optional<service::SubscriptionKey> key;
+	std::queue<std::variant<response::AwaitableValue, SharedPayload>> payloads;
+	std::shared_ptr<SharedSubscription> subscription;
+	std::shared_ptr<today::RequestState> requestStats;
 	bool registered = false;
 };
 
-static std::map<std::int32_t, peg::ast> queryMap;
+// Subscriptions with the same document, operationName and variables share one subscription in
+// the service, so each event is resolved and serialized once for all of them.
+class SharedSubscription : public std::enable_shared_from_this<SharedSubscription>
+{
+public:
+	explicit SharedSubscription(std::string&& signature)
+		: _signature(std::move(signature))
+	{
+	}
+
+	static std::shared_ptr<SharedSubscription> subscribe(const peg::ast& ast,
+		std::string&& operationName, const std::string& variables,
+		response::Value&& parsedVariables, const std::shared_ptr<SubscriptionPayloadQueue>& sink);
+
+	void removeSink(const SubscriptionPayloadQueue* sink);
+
+private:
+	void addSink(const std::shared_ptr<SubscriptionPayloadQueue>& sink)
+	{
+		std::lock_guard lock(_sinksMutex);
+
+		_sinks.emplace_back(sink.get(), sink);
+	}
+
+	void deliver(response::Value&& payload)
+	{
+		const auto json = std::make_shared<const std::string>(response::toJSON(std::move(payload)));
+		std::vector<std::shared_ptr<SubscriptionPayloadQueue>> sinks;
+
+		{
+			std::lock_guard lock(_sinksMutex);
+
+			sinks.reserve(_sinks.size());
+
+			for (const auto& entry : _sinks)
+			{
+				if (auto sink = entry.second.lock())
+				{
+					sinks.push_back(std::move(sink));
+				}
+			}
+		}
+
+		for (const auto& sink : sinks)
+		{
+			sink->Push(json);
+		}
+	}
+
+	const std::string _signature;
+	service::SubscriptionKey _key {};
+
+	std::mutex _sinksMutex;
+	std::vector<std::pair<const SubscriptionPayloadQueue*, std::weak_ptr<SubscriptionPayloadQueue>>>
+		_sinks;
+};
+
+static std::mutex sharedSubscriptionsMutex;
+static std::map<std::string, std::shared_ptr<SharedSubscription>> sharedSubscriptions;
+
+std::shared_ptr<SharedSubscription> SharedSubscription::subscribe(const peg::ast& ast,
+	std::string&& operationName, const std::string& variables, response::Value&& parsedVariables,
+	const std::shared_ptr<SubscriptionPayloadQueue>& sink)
+{
+	std::string signature { ast.root->string_view() };
+
+	signature.push_back('\0');
+	signature.append(operationName);
+	signature.push_back('\0');
+	signature.append(variables);
+
+	std::lock_guard lock(sharedSubscriptionsMutex);
+	auto itr = sharedSubscriptions.find(signature);
+
+	if (itr != sharedSubscriptions.end())
+	{
+		itr->second->addSink(sink);
+		return itr->second;
+	}
+
+	auto subscription = std::make_shared<SharedSubscription>(std::string { signature });
+	auto state = std::make_shared<SubscriptionState>(++requestId);
+
+	auto callback = [wpSubscription = std::weak_ptr { subscription }](
+						response::Value payload) noexcept -> void {
+		if (auto spSubscription = wpSubscription.lock())
+		{
+			spSubscription->deliver(std::move(payload));
+		}
+	};
+
+	auto pendingKey = serviceSingleton->subscribe({ std::move(callback),
+		peg::ast { ast },
+		std::move(operationName),
+		std::move(parsedVariables),
+		{},
+		state });
+
+	subscription->_key = pendingKey.get();
+
+	{
+		std::lock_guard stateLock(state->mutex);
+
+		router.add(subscription->_key, state, std::move(state->routes));
+	}
+
+	subscription->addSink(sink);
+	sharedSubscriptions.emplace(std::move(signature), subscription);
+
+	return subscription;
+}
+
+// The last sink to leave unsubscribes from the service.
+void SharedSubscription::removeSink(const SubscriptionPayloadQueue* sink)
+{
+	std::lock_guard lock(sharedSubscriptionsMutex);
+
+	{
+		std::lock_guard sinksLock(_sinksMutex);
+
+		std::erase_if(_sinks, [sink](const auto& entry) noexcept {
+			return entry.first == sink;
+		});
+
+		if (!_sinks.empty())
+		{
+			return;
+		}
+	}
+
+	auto itr = sharedSubscriptions.find(_signature);
+
+	if (itr != sharedSubscriptions.end() && itr->second.get() == this)
+	{
+		sharedSubscriptions.erase(itr);
+	}
+
+	if (serviceSingleton)
+	{
+		router.remove(_key);
+		serviceSingleton->unsubscribe({ _key }).get();
+	}
+}
+
+void SubscriptionPayloadQueue::Unsubscribe()
+{
+	std::unique_lock<std::mutex> lock(mutex);
+
+	if (!registered)
+	{
+		return;
+	}
+
+	registered = false;
+
+	auto deferUnsubscribe = std::move(subscription);
+
+	lock.unlock();
+	condition.notify_one();
+
+	if (deferUnsubscribe)
+	{
+		deferUnsubscribe->removeSink(this);
+	}
+}
+
+// Everything we can work out from the document is done once in parseQuery, not on every fetch.
+struct ParsedQuery
+{
+	peg::ast ast;
+	today::FieldMask fieldMask;
+};
+
+static std::map<std::int32_t, ParsedQuery> queryMap;
 static std::map<std::int32_t, std::shared_ptr<SubscriptionPayloadQueue>> subscriptionMap;
 
-NAN_METHOD(stopService)
+void teardownService()
 {
 	if (serviceSingleton)
 	{
+		deliveryPipeline.reset();
+
 		for (const auto& entry : subscriptionMap)
 		{
 			entry.second->Unsubscribe();
 		}
 
 		subscriptionMap.clear();
+		router.clear();
+
+		{
+			std::lock_guard lock(sharedSubscriptionsMutex);
+
+			sharedSubscriptions.clear();
+		}
 		queryMap.clear();
 		serviceSingleton.reset();
+		journal.reset();
 	}
 }
 
+NAN_METHOD(stopService)
+{
+	teardownService();
+}
+
 NAN_METHOD(parseQuery)
 {
 	std::string query(*Nan::Utf8String(To<String>(info[0]).ToLocalChecked()));
@@ -210,7 +812,9 @@ NAN_METHOD(parseQuery)
 			throw service::schema_exception { std::move(validationErrors) };
 		}
 
-		queryMap[queryId] = std::move(ast);
+		const auto fieldMask = today::FieldMask::fromDocument(ast);
+
+		queryMap[queryId] = { std::move(ast), fieldMask };
 		info.GetReturnValue().Set(New<Int32>(queryId));
 	}
 	catch (const std::exception& ex)
@@ -226,7 +830,24 @@ NAN_METHOD(discardQuery)
 	queryMap.erase(queryId);
 }
 
-class RegisteredSubscription : public AsyncProgressQueueWorker<std::string>
+// Counters from a finished request, e.g. to check that the BatchLoader fetched in one batch.
+response::Value makeRequestStats(const today::RequestState& state)
+{
+	response::Value stats { response::Type::Map };
+
+	stats.reserve(4);
+	stats.emplace_back("fetchEntities",
+		response::Value { static_cast<int>(state.fetchEntitiesCount.load()) });
+	stats.emplace_back("loadAppointments",
+		response::Value { static_cast<int>(state.loadAppointmentsCount) });
+	stats.emplace_back("loadTasks", response::Value { static_cast<int>(state.loadTasksCount) });
+	stats.emplace_back("loadUnreadCounts",
+		response::Value { static_cast<int>(state.loadUnreadCountsCount) });
+
+	return stats;
+}
+
+class RegisteredSubscription : public AsyncProgressQueueWorker<SharedPayload>
 {
 public:
 	explicit RegisteredSubscription(std::int32_t queryId, std::string&& operationName,
@@ -246,7 +867,7 @@ public:
 				throw std::runtime_error("Unknown queryId");
 			}
 
-			auto& ast = itrQuery->second;
+			auto& ast = itrQuery->second.ast;
 			auto parsedVariables = (variables.empty() ? response::Value(response::Type::Map)
 													  : response::parseJSON(variables));
 
@@ -261,34 +882,30 @@ public:
 				== service::strSubscription)
 			{
 				_payloadQueue->registered = true;
-				_payloadQueue->key = std::make_optional(
-					serviceSingleton
-						->subscribe(
-							{ [spQueue = _payloadQueue](response::Value payload) noexcept -> void {
-								 std::unique_lock<std::mutex> lock(spQueue->mutex);
-
-								 if (!spQueue->registered)
-								 {
-									 return;
-								 }
-
-								 std::promise<response::Value> promise;
-
-								 promise.set_value(std::move(payload));
-								 spQueue->payloads.push(promise.get_future());
-
-								 lock.unlock();
-								 spQueue->condition.notify_one();
-							 },
-								peg::ast { ast },
-								std::move(operationName),
-								std::move(parsedVariables) })
-						.get());
+				_payloadQueue->subscription = SharedSubscription::subscribe(ast,
+					std::move(operationName),
+					variables,
+					std::move(parsedVariables),
+					_payloadQueue);
 			}
 			else
 			{
-				_payloadQueue->payloads.push(
-					serviceSingleton->resolve({ ast, operationName, std::move(parsedVariables) }));
+				auto state = std::make_shared<today::RequestState>(++requestId);
+
+				state->fieldMask = itrQuery->second.fieldMask;
+				state->arena = std::make_shared<today::RequestArena>();
+				state->taskVersion = store->taskVersion();
+
+				if (reportRequestStats)
+				{
+					_payloadQueue->requestStats = state;
+				}
+
+				_payloadQueue->payloads.push(serviceSingleton->resolve({ ast,
+					operationName,
+					std::move(parsedVariables),
+					{},
+					std::move(state) }));
 
 				lock.unlock();
 				_payloadQueue->condition.notify_one();
@@ -336,7 +953,7 @@ private:
 			registered = spQueue->registered;
 			lock.unlock();
 
-			std::vector<std::string> json;
+			std::vector<SharedPayload> json;
 
 			while (!payloads.empty())
 			{
@@ -345,9 +962,15 @@ private:
 
 				payloads.pop();
 
+				if (auto shared = std::get_if<SharedPayload>(&payload))
+				{
+					json.push_back(std::move(*shared));
+					continue;
+				}
+
 				try
 				{
-					document = payload.get();
+					document = std::get<response::AwaitableValue>(payload).get();
 				}
 				catch (service::schema_exception& scx)
 				{
@@ -366,7 +989,13 @@ private:
 						response::Value { oss.str() });
 				}
 
-				json.push_back(response::toJSON(std::move(document)));
+				if (spQueue->requestStats)
+				{
+					document.emplace_back("extensions", makeRequestStats(*spQueue->requestStats));
+				}
+
+				json.push_back(
+					std::make_shared<const std::string>(response::toJSON(std::move(document))));
 			}
 
 			if (!json.empty())
@@ -379,7 +1008,7 @@ private:
 	// Executed when the async results are ready
 	// this function will be run inside the main event loop
 	// so it is safe to use V8 again
-	void HandleProgressCallback(const std::string* data, size_t size) override
+	void HandleProgressCallback(const SharedPayload* data, size_t size) override
 	{
 		if (data == nullptr)
 		{
@@ -391,7 +1020,7 @@ private:
 		while (size-- > 0)
 		{
 			Local<Value> argv[] = {
-				New<String>(data->c_str(), static_cast<int>(data->size())).ToLocalChecked()
+				New<String>((*data)->c_str(), static_cast<int>((*data)->size())).ToLocalChecked()
 			};
 
 			_next->Call(1, argv, async_resource);
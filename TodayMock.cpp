@@ -11,143 +11,2022 @@
 #include "TaskConnectionObject.h"
 #include "UnionTypeObject.h"
 
+#include "graphqlservice/internal/Grammar.h"
+
 #include <algorithm>
 #include <chrono>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <functional>
 #include <future>
 #include <iostream>
+#include <map>
+#include <stdexcept>
+#include <thread>
+#include <utility>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <io.h>
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace graphql::today {
+
+response::IdType GlobalId::encode(NodeType type, const response::IdType& rawId)
+{
+	response::IdType result(prefixSize + rawId.size());
+
+	result[0] = marker;
+	result[1] = static_cast<std::uint8_t>(type);
+	std::copy(rawId.cbegin(), rawId.cend(), result.begin() + prefixSize);
+
+	return result;
+}
+
+NodeType GlobalId::decode(std::span<const std::uint8_t> id) noexcept
+{
+	if (id.size() < prefixSize || id[0] != marker)
+	{
+		return NodeType::Unknown;
+	}
+
+	switch (static_cast<NodeType>(id[1]))
+	{
+		case NodeType::Appointment:
+		case NodeType::Task:
+		case NodeType::Folder:
+			return static_cast<NodeType>(id[1]);
+
+		default:
+			return NodeType::Unknown;
+	}
+}
+
+std::string_view GlobalId::key(std::span<const std::uint8_t> id) noexcept
+{
+	const size_t offset = (decode(id) == NodeType::Unknown ? 0 : prefixSize);
+
+	return { reinterpret_cast<const char*>(id.data()) + offset, id.size() - offset };
+}
+
+// Sorts the positions 0 to count - 1 by the GlobalId::key of the ID at each one.
+template <class _IdAt>
+std::vector<std::uint32_t> sortIds(size_t count, const _IdAt& idAt)
+{
+	std::vector<std::uint32_t> order(count);
+
+	for (size_t i = 0; i < count; ++i)
+	{
+		order[i] = static_cast<std::uint32_t>(i);
+	}
+
+	std::sort(order.begin(), order.end(), [&idAt](std::uint32_t lhs, std::uint32_t rhs) {
+		return GlobalId::key(idAt(lhs)) < GlobalId::key(idAt(rhs));
+	});
+
+	return order;
+}
+
+// Binary search of an IdOrder. A dataset's order is only checked as it's probed, if it's corrupt
+// the ID isn't found.
+template <class _IdAt>
+std::optional<size_t> findId(
+	IdOrder order, size_t count, std::span<const std::uint8_t> id, const _IdAt& idAt)
+{
+	const auto key = GlobalId::key(id);
+	size_t first = 0;
+	size_t last = order.size();
+
+	while (first < last)
+	{
+		const auto middle = first + (last - first) / 2;
+		const size_t position = order[middle];
+
+		if (position >= count)
+		{
+			return std::nullopt;
+		}
+
+		const auto probe = GlobalId::key(idAt(position));
+
+		if (probe < key)
+		{
+			first = middle + 1;
+		}
+		else if (key < probe)
+		{
+			last = middle;
+		}
+		else
+		{
+			return std::make_optional(position);
+		}
+	}
+
+	return std::nullopt;
+}
+
+// Offsets into a byte section start at 0 and end inside the section. The offsets in between are
+// checked as each entry is read.
+bool validOffsets(std::span<const std::uint64_t> offsets, size_t byteCount) noexcept
+{
+	return !offsets.empty() && offsets.front() == 0 && offsets.back() <= byteCount;
+}
+
+// TaskState values read back from a dataset or a journal.
+bool validTaskState(TaskState state) noexcept
+{
+	return state >= TaskState::New && state <= TaskState::Unassigned;
+}
+
+void appendUint64(response::IdType& bytes, std::uint64_t value)
+{
+	for (size_t i = 0; i < sizeof(value); ++i)
+	{
+		bytes.push_back(static_cast<std::uint8_t>(value >> (8 * i)));
+	}
+}
+
+std::uint64_t readUint64(const std::uint8_t* bytes) noexcept
+{
+	std::uint64_t value = 0;
+
+	for (size_t i = 0; i < sizeof(value); ++i)
+	{
+		value |= static_cast<std::uint64_t>(bytes[i]) << (8 * i);
+	}
+
+	return value;
+}
+
+response::IdType ItemCursor::encode(
+	NodeType type, size_t version, size_t position, std::span<const std::uint8_t> id)
+{
+	response::IdType cursor;
+
+	cursor.reserve(headerSize + id.size());
+	cursor.push_back(marker);
+	cursor.push_back(static_cast<std::uint8_t>(type));
+	appendUint64(cursor, static_cast<std::uint64_t>(version));
+	appendUint64(cursor, static_cast<std::uint64_t>(position));
+	cursor.insert(cursor.end(), id.begin(), id.end());
+
+	return cursor;
+}
+
+ItemCursor ItemCursor::decode(response::IdType&& cursor)
+{
+	if (cursor.size() < headerSize || cursor.front() != marker)
+	{
+		return { NodeType::Unknown, 0, std::nullopt, std::move(cursor) };
+	}
+
+	return {
+		static_cast<NodeType>(cursor[1]),
+		static_cast<size_t>(readUint64(cursor.data() + 2)),
+		std::make_optional(
+			static_cast<size_t>(readUint64(cursor.data() + 2 + sizeof(std::uint64_t)))),
+		response::IdType { cursor.cbegin() + headerSize, cursor.cend() },
+	};
+}
+
+// Sorts the entries unless the loader's IdOrder already matches them.
+template <class _Object>
+std::vector<std::uint32_t> sortEntries(
+	const std::vector<std::shared_ptr<_Object>>& entries, IdOrder order)
+{
+	if (order.size() == entries.size())
+	{
+		return {};
+	}
+
+	return sortIds(entries.size(), [&entries](size_t position) {
+		return entries[position]->id();
+	});
+}
+
+// Every Snapshot and EntityStore gets a new version, so cursors from an older one can be detected.
+std::atomic<size_t> nextSnapshotVersion = 0;
+
+template <class _Object>
+Snapshot<_Object>::Snapshot()
+	: version(++nextSnapshotVersion)
+{
+}
+
+template <class _Object>
+Snapshot<_Object>::Snapshot(vec_type&& objects, const FieldMask& loadedFields, IdOrder order)
+	: version(++nextSnapshotVersion)
+	, entries(std::move(objects))
+	, fields(loadedFields)
+	, _sorted(sortEntries(entries, order))
+	, _order(_sorted.empty() ? order : IdOrder { _sorted })
+	, _wrappers(std::make_unique<std::atomic<std::shared_ptr<wrapper_type>>[]>(entries.size()))
+{
+}
+
+template <class _Object>
+std::optional<size_t> Snapshot<_Object>::find(std::span<const std::uint8_t> id) const noexcept
+{
+	return findId(_order, entries.size(), id, [this](size_t position) {
+		return entries[position]->id();
+	});
+}
+
+template <class _Object>
+std::optional<size_t> Snapshot<_Object>::seek(const ItemCursor& cursor) const noexcept
+{
+	constexpr auto nodeType = ObjectWrapper<_Object>::nodeType;
+
+	if (cursor.position && cursor.type != nodeType)
+	{
+		// An edge from another collection, its position means nothing here.
+		return std::nullopt;
+	}
+
+	// Versions only count up within one process, so make sure the row at that position is still
+	// the one the cursor points to, e.g. after a restart or from another process sharing the
+	// dataset.
+	if (cursor.version == version && cursor.position && *cursor.position < entries.size()
+		&& GlobalId::key(entries[*cursor.position]->id()) == GlobalId::key(cursor.id))
+	{
+		return cursor.position;
+	}
+
+	auto position = find(cursor.id);
+
+	// Every Snapshot takes a new version, so a cursor from a later one can't have come from an
+	// earlier version of this collection.
+	if (!position && cursor.position && cursor.version <= version && !entries.empty())
+	{
+		// The node was deleted, the next node has taken its place.
+		position = std::make_optional(std::min(*cursor.position, entries.size() - 1));
+	}
+
+	return position;
+}
+
+template <class _Object>
+std::shared_ptr<typename Snapshot<_Object>::wrapper_type> Snapshot<_Object>::wrap(
+	size_t position) const
+{
+	auto& slot = _wrappers[position];
+	auto wrapper = slot.load();
+
+	if (!wrapper)
+	{
+		auto created = std::make_shared<wrapper_type>(entries[position]);
+
+		// Another request may have beaten us to it, everyone shares whichever one was stored.
+		wrapper = slot.compare_exchange_strong(wrapper, created) ? std::move(created) : wrapper;
+	}
+
+	return wrapper;
+}
+
+template <class _Object>
+std::shared_ptr<typename Snapshot<_Object>::wrapper_type> Snapshot<_Object>::wrap(
+	const std::shared_ptr<_Object>& entity) const
+{
+	const auto position = find(entity->id());
+
+	if (!position || entries[*position] != entity)
+	{
+		return std::make_shared<wrapper_type>(entity);
+	}
+
+	return wrap(*position);
+}
+
+// The connection edges in TodayMock.h call wrap through these.
+template struct Snapshot<Appointment>;
+template struct Snapshot<Task>;
+template struct Snapshot<Folder>;
+
+// Reports a cursor which the page loader couldn't find.
+size_t cursorPosition(std::string_view argument, std::optional<size_t> position)
+{
+	if (!position)
+	{
+		std::ostringstream error;
+
+		error << "Invalid argument: " << argument << " cursor not found";
+		throw service::schema_exception { { service::schema_error { error.str() } } };
+	}
+
+	return *position;
+}
+
+// Range of positions from first up to last which a PageWindow selects out of count entries, seek
+// returns the position of each cursor.
+template <class _Seek>
+std::pair<size_t, size_t> pageRange(size_t count, const PageWindow& window, const _Seek& seek)
+{
+	size_t itrFirst = 0;
+	size_t itrLast = count;
+
+	if (window.after)
+	{
+		itrFirst = seek("after", *window.after);
+	}
+
+	if (window.before)
+	{
+		const auto itrBefore = seek("before", *window.before);
+
+		if (itrBefore >= itrFirst)
+		{
+			itrLast = itrBefore + 1;
+		}
+	}
+
+	if (window.first && itrLast - itrFirst > static_cast<size_t>(*window.first))
+	{
+		itrLast = itrFirst + static_cast<size_t>(*window.first);
+	}
+
+	if (window.last && itrLast - itrFirst > static_cast<size_t>(*window.last))
+	{
+		itrFirst = itrLast - static_cast<size_t>(*window.last);
+	}
+
+	return { itrFirst, itrLast };
+}
+
+BatchLoader::~BatchLoader()
+{
+	for (auto& request : _pending)
+	{
+		request.result.set_exception(
+			std::make_exception_ptr(std::runtime_error("The batch was never fetched")));
+	}
+}
+
+void BatchLoader::beginSelectionSet() noexcept
+{
+	std::lock_guard lock(_mutex);
+
+	++_depth;
+}
+
+std::vector<BatchLoader::Request> BatchLoader::endSelectionSet()
+{
+	std::lock_guard lock(_mutex);
+
+	if (_depth == 0 || --_depth > 0)
+	{
+		return {};
+	}
+
+	_results.clear();
+
+	return std::exchange(_pending, {});
+}
+
+std::optional<Eventual<NodeEntity>> BatchLoader::load(NodeType type, const response::IdType& id)
+{
+	std::lock_guard lock(_mutex);
+
+	if (_depth == 0)
+	{
+		return std::nullopt;
+	}
+
+	auto [itr, inserted] = _results.try_emplace({ type, id });
+
+	if (inserted)
+	{
+		_pending.push_back(Request { type, id, {}, itr->second });
+	}
+
+	return itr->second;
+}
+
+FieldMask FieldMask::fromDocument(const peg::ast& query)
+{
+	FieldMask result { false, false, false, false, false };
+	std::vector<const peg::ast_node*> nodes { query.root.get() };
+
+	// Fields in fragments count too, whether or not they are spread in the operation.
+	while (!nodes.empty())
+	{
+		const auto node = nodes.back();
+
+		nodes.pop_back();
+
+		if (node->is_type<peg::field_name>())
+		{
+			const auto fieldName = node->string_view();
+
+			// Switch on the length first, so most field names are never compared.
+			switch (fieldName.size())
+			{
+				case 4:
+					result.when = result.when || fieldName == "when";
+					result.name = result.name || fieldName == "name";
+					break;
+
+				case 5:
+					result.edges = result.edges || fieldName == "edges";
+					result.title = result.title || fieldName == "title";
+					break;
+
+				case 7:
+					result.subject = result.subject || fieldName == "subject";
+					break;
+
+				default:
+					break;
+			}
+
+			continue;
+		}
+
+		for (const auto& child : node->children)
+		{
+			nodes.push_back(child.get());
+		}
+	}
+
+	return result;
+}
+
+bool FieldMask::covers(const FieldMask& other) const noexcept
+{
+	return (edges || !other.edges) && (when || !other.when) && (subject || !other.subject)
+		&& (title || !other.title) && (name || !other.name);
+}
+
+FieldMask& FieldMask::operator|=(const FieldMask& other) noexcept
+{
+	edges = edges || other.edges;
+	when = when || other.when;
+	subject = subject || other.subject;
+	title = title || other.title;
+	name = name || other.name;
+
+	return *this;
+}
+
+static FieldMask requestedFields(const std::shared_ptr<service::RequestState>& state) noexcept
+{
+	return state ? std::static_pointer_cast<RequestState>(state)->fieldMask : FieldMask {};
+}
+
+static std::shared_ptr<RequestArena> requestArena(
+	const std::shared_ptr<service::RequestState>& state) noexcept
+{
+	return state ? std::static_pointer_cast<RequestState>(state)->arena : nullptr;
+}
+
+void* RequestArena::do_allocate(size_t bytes, size_t alignment)
+{
+	std::lock_guard lock(_mutex);
+
+	return _resource.allocate(bytes, alignment);
+}
+
+// Released all at once with the arena.
+void RequestArena::do_deallocate(void*, size_t, size_t) noexcept
+{
+}
+
+bool RequestArena::do_is_equal(const std::pmr::memory_resource& other) const noexcept
+{
+	return this == &other;
+}
+
+StringPool::StringPool()
+	: _index(0, IndexHash { this }, IndexEqual { this })
+{
+	// Index 0 is an empty entry for null.
+	_views.push_back({});
+}
+
+std::uint32_t StringPool::intern(std::optional<std::string>&& value)
+{
+	if (!value)
+	{
+		return 0;
+	}
+
+	std::lock_guard lock(_internMutex);
+	const auto itr = _index.find(std::string_view { *value });
+
+	if (itr != _index.end())
+	{
+		return *itr;
+	}
+
+	const auto index = static_cast<std::uint32_t>(_views.size());
+
+	_views.push_back(_owned.emplace_back(std::move(*value)));
+	_index.insert(index);
+
+	return index;
+}
+
+void StringPool::map(std::span<const std::uint64_t> offsets, std::span<const char> bytes)
+{
+	if (offsets.size() < 2 || !validOffsets(offsets, bytes.size()))
+	{
+		throw std::runtime_error("Invalid dataset string table");
+	}
+
+	std::lock_guard lock(_internMutex);
+
+	_index.clear();
+	_mapped = true;
+	_mappedOffsets = offsets;
+	_mappedBytes = bytes;
+}
+
+std::vector<std::uint64_t> StringPool::offsets() const
+{
+	if (_mapped)
+	{
+		return { _mappedOffsets.begin(), _mappedOffsets.end() };
+	}
+
+	std::lock_guard lock(_internMutex);
+	std::vector<std::uint64_t> offsets;
+	std::uint64_t offset = 0;
+
+	offsets.reserve(_views.size() + 1);
+	offsets.push_back(offset);
+
+	for (size_t i = 0; i < _views.size(); ++i)
+	{
+		offset += _views[i].size();
+		offsets.push_back(offset);
+	}
+
+	return offsets;
+}
+
+std::vector<char> StringPool::bytes() const
+{
+	if (_mapped)
+	{
+		return { _mappedBytes.begin(), _mappedBytes.end() };
+	}
+
+	std::lock_guard lock(_internMutex);
+	std::vector<char> bytes;
+
+	for (size_t i = 0; i < _views.size(); ++i)
+	{
+		bytes.insert(bytes.end(), _views[i].begin(), _views[i].end());
+	}
+
+	return bytes;
+}
+
+std::shared_ptr<const response::Value> StringPool::operator[](std::uint32_t index) const
+{
+	static const auto nullValue = std::make_shared<const response::Value>();
+
+	if (index == 0)
+	{
+		return nullValue;
+	}
+
+	if (!valid(index))
+	{
+		throw std::runtime_error("Invalid dataset string index");
+	}
+
+	return _values.get(index, [this, index]() {
+		return response::Value(std::string { view(index) });
+	});
+}
+
+std::shared_ptr<const TaskVersion> TaskColumns::pinned(
+	const std::shared_ptr<service::RequestState>& state) const
+{
+	if (state)
+	{
+		auto taskVersion = std::static_pointer_cast<RequestState>(state)->taskVersion.load();
+
+		if (taskVersion && taskVersion->columns == this)
+		{
+			return taskVersion;
+		}
+	}
+
+	return version.load();
+}
+
+bool TaskColumns::getIsComplete(const TaskVersion& taskVersion, size_t row) const noexcept
+{
+	const auto chunkIndex = row / TaskVersion::chunkSize;
+
+	if (chunkIndex < taskVersion.chunks.size() && taskVersion.chunks[chunkIndex])
+	{
+		return taskVersion.chunks[chunkIndex]->isComplete[row % TaskVersion::chunkSize] != 0;
+	}
+
+	return isComplete[row] != 0;
+}
+
+TaskState TaskColumns::getState(const TaskVersion& taskVersion, size_t row) const noexcept
+{
+	const auto chunkIndex = row / TaskVersion::chunkSize;
+
+	if (chunkIndex < taskVersion.chunks.size() && taskVersion.chunks[chunkIndex])
+	{
+		return taskVersion.chunks[chunkIndex]->state[row % TaskVersion::chunkSize];
+	}
+
+	return state[row];
+}
+
+IdColumn::IdColumn()
+{
+	_offsets.push_back(0);
+}
+
+void IdColumn::push_back(const response::IdType& id)
+{
+	_bytes.append(id);
+	_offsets.push_back(_bytes.size());
+}
+
+void IdColumn::map(std::span<const std::uint64_t> offsets, std::span<const std::uint8_t> bytes,
+	IdOrder order)
+{
+	if (!validOffsets(offsets, bytes.size()))
+	{
+		throw std::runtime_error("Invalid dataset ID column");
+	}
+
+	if (order.size() != offsets.size() - 1)
+	{
+		throw std::runtime_error("Invalid dataset ID index");
+	}
+
+	_offsets.map(offsets);
+	_bytes.map(bytes);
+	_order.map(order);
+
+	// The dataset's order is used as is, so it's never sorted again.
+	std::call_once(_orderOnce, [this]() noexcept {
+		_ordered.store(true, std::memory_order_release);
+	});
+}
+
+std::shared_ptr<const response::Value> IdColumn::value(size_t row) const
+{
+	if (!valid(row))
+	{
+		throw std::runtime_error("Invalid dataset ID column");
+	}
+
+	return _values.get(row, [this, row]() {
+		const auto id = (*this)[row];
+
+		return response::Value(response::IdType { id.begin(), id.end() });
+	});
+}
+
+IdOrder IdColumn::order() const
+{
+	std::call_once(_orderOnce, [this]() {
+		_order.append(sortIds(size(), [this](size_t row) {
+			return (*this)[row];
+		}));
+		_ordered.store(true, std::memory_order_release);
+	});
+
+	return _order.values();
+}
+
+std::optional<size_t> IdColumn::find(std::span<const std::uint8_t> id) const
+{
+	return findId(order(), size(), id, [this](size_t row) {
+		return (*this)[row];
+	});
+}
+
+MappedFile::MappedFile(const std::string& path)
+{
+#ifdef _WIN32
+	const auto file = CreateFileA(path.c_str(),
+		GENERIC_READ,
+		FILE_SHARE_READ,
+		nullptr,
+		OPEN_EXISTING,
+		FILE_ATTRIBUTE_NORMAL,
+		nullptr);
+
+	if (file == INVALID_HANDLE_VALUE)
+	{
+		throw std::runtime_error("Cannot open dataset: " + path);
+	}
+
+	LARGE_INTEGER size {};
+	const auto mapping = GetFileSizeEx(file, &size) && size.QuadPart > 0
+		? CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr)
+		: nullptr;
+
+	// The view keeps the file and the mapping open after we close the handles.
+	CloseHandle(file);
+
+	if (!mapping)
+	{
+		throw std::runtime_error("Cannot map dataset: " + path);
+	}
+
+	_data = static_cast<const std::uint8_t*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+	_size = static_cast<size_t>(size.QuadPart);
+	CloseHandle(mapping);
+#else
+	const int fd = open(path.c_str(), O_RDONLY);
+
+	if (fd < 0)
+	{
+		throw std::runtime_error("Cannot open dataset: " + path);
+	}
+
+	struct stat status {};
+	void* data = MAP_FAILED;
+
+	if (fstat(fd, &status) == 0 && status.st_size > 0)
+	{
+		data = mmap(nullptr, static_cast<size_t>(status.st_size), PROT_READ, MAP_SHARED, fd, 0);
+	}
+
+	// The mapping keeps the file open after we close the descriptor.
+	close(fd);
+
+	if (data != MAP_FAILED)
+	{
+		_data = static_cast<const std::uint8_t*>(data);
+		_size = static_cast<size_t>(status.st_size);
+	}
+#endif
+
+	if (!_data)
+	{
+		throw std::runtime_error("Cannot map dataset: " + path);
+	}
+}
+
+MappedFile::~MappedFile()
+{
+#ifdef _WIN32
+	UnmapViewOfFile(_data);
+#else
+	munmap(const_cast<std::uint8_t*>(_data), _size);
+#endif
+}
+
+// Dataset files start with a DatasetHeader, followed by each section aligned to 8 bytes. They are
+// written in host byte order, so they are only portable between hosts with the same endianness.
+enum DatasetSection : size_t
+{
+	StringOffsets,
+	StringBytes,
+	AppointmentIdOffsets,
+	AppointmentIdBytes,
+	AppointmentWhen,
+	AppointmentSubject,
+	AppointmentIsNow,
+	TaskIdOffsets,
+	TaskIdBytes,
+	TaskTitle,
+	TaskIsComplete,
+	TaskStates,
+	FolderIdOffsets,
+	FolderIdBytes,
+	FolderName,
+	FolderUnreadCount,
+	AppointmentIdOrder,
+	TaskIdOrder,
+	FolderIdOrder,
+	SectionCount,
+};
+
+struct DatasetHeader
+{
+	// "TDAY" in a little-endian file
+	static constexpr std::uint32_t magicValue = 0x59414454;
+	static constexpr std::uint32_t currentVersion = 2;
+
+	struct Extent
+	{
+		std::uint64_t offset;
+		std::uint64_t count;
+	};
+
+	std::uint32_t magic = magicValue;
+	std::uint32_t version = currentVersion;
+	Extent sections[SectionCount] {};
+};
+
+template <class _Range>
+void writeSection(
+	std::ofstream& out, DatasetHeader& header, DatasetSection section, const _Range& values)
+{
+	constexpr char padding[alignof(std::uint64_t)] {};
+	const auto position = static_cast<std::uint64_t>(out.tellp());
+	const auto paddingSize = (sizeof(padding) - position % sizeof(padding)) % sizeof(padding);
+
+	out.write(padding, static_cast<std::streamsize>(paddingSize));
+	header.sections[section] = { position + paddingSize, values.size() };
+	out.write(reinterpret_cast<const char*>(values.data()),
+		static_cast<std::streamsize>(values.size() * sizeof(*values.data())));
+}
+
+template <class _Type>
+std::span<const _Type> mapSection(
+	std::span<const std::uint8_t> bytes, const DatasetHeader& header, DatasetSection section)
+{
+	const auto& extent = header.sections[section];
+
+	if (extent.offset % alignof(_Type) != 0 || extent.offset > bytes.size()
+		|| extent.count > (bytes.size() - extent.offset) / sizeof(_Type))
+	{
+		throw std::runtime_error("Invalid dataset section");
+	}
+
+	return { reinterpret_cast<const _Type*>(bytes.data() + extent.offset),
+		static_cast<size_t>(extent.count) };
+}
+
+EntityStore::EntityStore()
+	: _version(++nextSnapshotVersion)
+{
+	auto taskVersion = std::make_shared<TaskVersion>();
+
+	taskVersion->columns = &_taskColumns;
+	_taskColumns.version.store(std::move(taskVersion));
+}
+
+std::shared_ptr<EntityStore> EntityStore::load(const std::string& path)
+{
+	auto file = std::make_unique<MappedFile>(path);
+	const auto bytes = file->bytes();
+	DatasetHeader header;
+
+	if (bytes.size() < sizeof(header))
+	{
+		throw std::runtime_error("Invalid dataset header");
+	}
+
+	std::memcpy(&header, bytes.data(), sizeof(header));
+
+	if (header.magic != DatasetHeader::magicValue
+		|| header.version != DatasetHeader::currentVersion)
+	{
+		throw std::runtime_error("Unsupported dataset version");
+	}
+
+	auto store = std::make_shared<EntityStore>();
+
+	store->_strings.map(mapSection<std::uint64_t>(bytes, header, StringOffsets),
+		mapSection<char>(bytes, header, StringBytes));
+
+	store->_appointmentColumns.id.map(
+		mapSection<std::uint64_t>(bytes, header, AppointmentIdOffsets),
+		mapSection<std::uint8_t>(bytes, header, AppointmentIdBytes),
+		mapSection<std::uint32_t>(bytes, header, AppointmentIdOrder));
+	store->_appointmentColumns.when.map(
+		mapSection<std::uint32_t>(bytes, header, AppointmentWhen));
+	store->_appointmentColumns.subject.map(
+		mapSection<std::uint32_t>(bytes, header, AppointmentSubject));
+	store->_appointmentColumns.isNow.map(
+		mapSection<std::uint8_t>(bytes, header, AppointmentIsNow));
+
+	store->_taskColumns.id.map(mapSection<std::uint64_t>(bytes, header, TaskIdOffsets),
+		mapSection<std::uint8_t>(bytes, header, TaskIdBytes),
+		mapSection<std::uint32_t>(bytes, header, TaskIdOrder));
+	store->_taskColumns.title.map(mapSection<std::uint32_t>(bytes, header, TaskTitle));
+	store->_taskColumns.isComplete.map(mapSection<std::uint8_t>(bytes, header, TaskIsComplete));
+	store->_taskColumns.state.map(mapSection<TaskState>(bytes, header, TaskStates));
+
+	store->_folderColumns.id.map(mapSection<std::uint64_t>(bytes, header, FolderIdOffsets),
+		mapSection<std::uint8_t>(bytes, header, FolderIdBytes),
+		mapSection<std::uint32_t>(bytes, header, FolderIdOrder));
+	store->_folderColumns.name.map(mapSection<std::uint32_t>(bytes, header, FolderName));
+	store->_folderColumns.unreadCount.map(
+		mapSection<std::int32_t>(bytes, header, FolderUnreadCount));
+
+	const auto& appointments = store->_appointmentColumns;
+	const auto& tasks = store->_taskColumns;
+	const auto& folders = store->_folderColumns;
+
+	if (appointments.when.size() != appointments.id.size()
+		|| appointments.subject.size() != appointments.id.size()
+		|| appointments.isNow.size() != appointments.id.size()
+		|| tasks.title.size() != tasks.id.size() || tasks.isComplete.size() != tasks.id.size()
+		|| tasks.state.size() != tasks.id.size() || folders.name.size() != folders.id.size()
+		|| folders.unreadCount.size() != folders.id.size())
+	{
+		throw std::runtime_error("Invalid dataset columns");
+	}
+
+	// Nothing else scans the rows, the string indexes and task states are checked as they're read.
+	store->_file = std::move(file);
+
+	return store;
+}
+
+// Flushes a file, or a directory on POSIX, which was written through another handle.
+bool syncPath(const std::filesystem::path& path, bool directory) noexcept
+{
+#ifdef _WIN32
+	// Windows has no way to flush a directory, renames are journaled by NTFS.
+	if (directory)
+	{
+		return true;
+	}
+
+	const auto file = _wfopen(path.c_str(), L"r+b");
+
+	if (!file)
+	{
+		return false;
+	}
+
+	const bool synced = _commit(_fileno(file)) == 0;
+
+	std::fclose(file);
+	return synced;
+#else
+	const int fd = open(path.c_str(), directory ? O_RDONLY | O_DIRECTORY : O_RDWR);
+
+	if (fd < 0)
+	{
+		return false;
+	}
+
+	const bool synced = fsync(fd) == 0;
+
+	close(fd);
+	return synced;
+#endif
+}
+
+void EntityStore::save(const std::string& path) const
+{
+	// Write a new file and only rename it over the dataset once it's durable, so a crash leaves
+	// either the old dataset or the new one.
+	const auto tempPath = path + ".tmp";
+
+	try
+	{
+		writeDataset(tempPath);
+
+		if (!syncPath(tempPath, false))
+		{
+			throw std::runtime_error("Cannot sync dataset: " + path);
+		}
+
+		std::filesystem::rename(tempPath, path);
+	}
+	catch (...)
+	{
+		std::error_code ec;
+
+		std::filesystem::remove(tempPath, ec);
+		throw;
+	}
+
+	const auto directory = std::filesystem::absolute(path).parent_path();
+
+	if (!syncPath(directory, true))
+	{
+		throw std::runtime_error("Cannot sync dataset directory: " + directory.string());
+	}
+}
+
+void EntityStore::writeDataset(const std::string& path) const
+{
+	std::ofstream out(path, std::ios::binary | std::ios::trunc);
+	DatasetHeader header;
+
+	out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+
+	writeSection(out, header, StringOffsets, _strings.offsets());
+	writeSection(out, header, StringBytes, _strings.bytes());
+
+	writeSection(out, header, AppointmentIdOffsets, _appointmentColumns.id.offsets());
+	writeSection(out, header, AppointmentIdBytes, _appointmentColumns.id.bytes());
+	writeSection(out, header, AppointmentWhen, _appointmentColumns.when.values());
+	writeSection(out, header, AppointmentSubject, _appointmentColumns.subject.values());
+	writeSection(out, header, AppointmentIsNow, _appointmentColumns.isNow.values());
+
+	writeSection(out, header, TaskIdOffsets, _taskColumns.id.offsets());
+	writeSection(out, header, TaskIdBytes, _taskColumns.id.bytes());
+	writeSection(out, header, TaskTitle, _taskColumns.title.values());
+	// Fold the updates in the current TaskVersion into the dataset.
+	const auto taskVersion = _taskColumns.version.load();
+	std::vector<std::uint8_t> isComplete(_taskColumns.id.size());
+	std::vector<TaskState> states(_taskColumns.id.size());
+
+	for (size_t row = 0; row < isComplete.size(); ++row)
+	{
+		isComplete[row] = _taskColumns.getIsComplete(*taskVersion, row) ? 1 : 0;
+		states[row] = _taskColumns.getState(*taskVersion, row);
+
+		if (!validTaskState(states[row]))
+		{
+			throw std::runtime_error("Invalid dataset task state");
+		}
+	}
+
+	writeSection(out, header, TaskIsComplete, isComplete);
+	writeSection(out, header, TaskStates, states);
+
+	writeSection(out, header, FolderIdOffsets, _folderColumns.id.offsets());
+	writeSection(out, header, FolderIdBytes, _folderColumns.id.bytes());
+	writeSection(out, header, FolderName, _folderColumns.name.values());
+	writeSection(out, header, FolderUnreadCount, _folderColumns.unreadCount.values());
+
+	writeSection(out, header, AppointmentIdOrder, _appointmentColumns.id.order());
+	writeSection(out, header, TaskIdOrder, _taskColumns.id.order());
+	writeSection(out, header, FolderIdOrder, _folderColumns.id.order());
+
+	out.seekp(0);
+	out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+	out.close();
+
+	if (!out)
+	{
+		throw std::runtime_error("Cannot write dataset: " + path);
+	}
+}
+
+IdOrder EntityStore::appointmentOrder() const
+{
+	return _appointmentColumns.id.order();
+}
+
+IdOrder EntityStore::taskOrder() const
+{
+	return _taskColumns.id.order();
+}
+
+IdOrder EntityStore::folderOrder() const
+{
+	return _folderColumns.id.order();
+}
+
+std::optional<size_t> EntityStore::findTask(std::span<const std::uint8_t> id) const
+{
+	return _taskColumns.id.find(id);
+}
+
+std::shared_ptr<Task> EntityStore::task(std::span<const std::uint8_t> id)
+{
+	const auto position = findTask(id);
+
+	return position ? row(_tasks, _taskColumns, *position) : nullptr;
+}
+
+std::shared_ptr<const TaskVersion> EntityStore::updateTask(std::span<const std::uint8_t> id,
+	std::optional<bool> isComplete, std::optional<TaskState> state)
+{
+	const auto position = findTask(id);
+
+	if (!position)
+	{
+		return nullptr;
+	}
+
+	const auto chunkIndex = *position / TaskVersion::chunkSize;
+	const auto chunkOffset = *position % TaskVersion::chunkSize;
+	auto current = _taskColumns.version.load();
+	std::shared_ptr<const TaskVersion> next;
+
+	do
+	{
+		auto version = std::make_shared<TaskVersion>(*current);
+		const auto& previous =
+			chunkIndex < current->chunks.size() ? current->chunks[chunkIndex] : nullptr;
+		auto chunk = previous ? std::make_shared<TaskVersion::Chunk>(*previous)
+							  : std::make_shared<TaskVersion::Chunk>();
+
+		if (!previous)
+		{
+			const auto first = chunkIndex * TaskVersion::chunkSize;
+			const auto count = std::min(TaskVersion::chunkSize, _taskColumns.id.size() - first);
+
+			for (size_t i = 0; i < count; ++i)
+			{
+				chunk->isComplete[i] = _taskColumns.isComplete[first + i];
+				chunk->state[i] = _taskColumns.state[first + i];
+
+				// The dataset's task states are checked a chunk at a time, as they're copied.
+				if (!validTaskState(chunk->state[i]))
+				{
+					throw std::runtime_error("Invalid dataset task state");
+				}
+			}
+		}
+
+		if (isComplete)
+		{
+			chunk->isComplete[chunkOffset] = *isComplete ? 1 : 0;
+		}
+
+		if (state)
+		{
+			chunk->state[chunkOffset] = *state;
+		}
+
+		if (version->chunks.size() <= chunkIndex)
+		{
+			version->chunks.resize(chunkIndex + 1);
+		}
+
+		version->chunks[chunkIndex] = std::move(chunk);
+		++version->version;
+		next = std::move(version);
+	} while (!_taskColumns.version.compare_exchange_weak(current, next));
+
+	if (_changeLog)
+	{
+		_changeLog->append(NodeType::Task, row(_tasks, _taskColumns, *position), next);
+	}
+
+	return next;
+}
+
+std::shared_ptr<const TaskVersion> EntityStore::taskVersion() const noexcept
+{
+	return _taskColumns.version.load();
+}
+
+void EntityStore::captureChanges(std::shared_ptr<ChangeLog> changeLog) noexcept
+{
+	_changeLog = std::move(changeLog);
+}
+
+void ChangeLog::append(
+	NodeType type, NodeEntity&& entity, std::shared_ptr<const TaskVersion> taskVersion)
+{
+	{
+		std::lock_guard lock(_mutex);
+
+		if (_closed)
+		{
+			return;
+		}
+
+		_events.push_back({ _nextSequence++, type, std::move(entity), std::move(taskVersion) });
+	}
+
+	_condition.notify_one();
+}
+
+std::vector<ChangeEvent> ChangeLog::consume()
+{
+	std::unique_lock lock(_mutex);
+
+	_condition.wait(lock, [this]() noexcept {
+		return _closed || !_events.empty();
+	});
+
+	return std::exchange(_events, {});
+}
+
+void ChangeLog::close()
+{
+	{
+		std::lock_guard lock(_mutex);
+
+		_closed = true;
+	}
+
+	_condition.notify_all();
+}
+
+void EntityStore::checkWritable() const
+{
+	if (_file || _appointmentColumns.id.ordered() || _taskColumns.id.ordered()
+		|| _folderColumns.id.ordered())
+	{
+		throw std::runtime_error("The dataset is read-only");
+	}
+}
+
+template <class _Row, class _Columns>
+std::shared_ptr<_Row> EntityStore::row(
+	std::deque<_Row>& rows, const _Columns& columns, size_t position)
+{
+	std::lock_guard lock(_rowsMutex);
+
+	while (rows.size() <= position)
+	{
+		rows.emplace_back(columns, _strings, rows.size());
+	}
+
+	return { shared_from_this(), &rows[position] };
+}
+
+template <class _Row, class _Columns>
+std::vector<std::shared_ptr<_Row>> EntityStore::rows(
+	std::deque<_Row>& rows, const _Columns& columns)
+{
+	std::lock_guard lock(_rowsMutex);
+	const auto spThis = shared_from_this();
+
+	while (rows.size() < columns.id.size())
+	{
+		rows.emplace_back(columns, _strings, rows.size());
+	}
+
+	std::vector<std::shared_ptr<_Row>> result;
+
+	result.reserve(rows.size());
+
+	for (auto& entry : rows)
+	{
+		result.emplace_back(spThis, &entry);
+	}
+
+	return result;
+}
+
+std::shared_ptr<Appointment> EntityStore::addAppointment(response::IdType&& id,
+	std::optional<std::string>&& when, std::optional<std::string>&& subject, bool isNow)
+{
+	checkWritable();
+	_appointmentColumns.id.push_back(id);
+	_appointmentColumns.when.push_back(_strings.intern(std::move(when)));
+	_appointmentColumns.subject.push_back(_strings.intern(std::move(subject)));
+	_appointmentColumns.isNow.push_back(isNow ? 1 : 0);
+
+	return row(_appointments, _appointmentColumns, _appointmentColumns.id.size() - 1);
+}
+
+std::shared_ptr<Task> EntityStore::addTask(
+	response::IdType&& id, std::optional<std::string>&& title, bool isComplete)
+{
+	checkWritable();
+	_taskColumns.id.push_back(id);
+	_taskColumns.title.push_back(_strings.intern(std::move(title)));
+	_taskColumns.isComplete.push_back(isComplete ? 1 : 0);
+	_taskColumns.state.push_back(TaskState::New);
+
+	return row(_tasks, _taskColumns, _taskColumns.id.size() - 1);
+}
+
+std::shared_ptr<Folder> EntityStore::addFolder(
+	response::IdType&& id, std::optional<std::string>&& name, int unreadCount)
+{
+	checkWritable();
+	_folderColumns.id.push_back(id);
+	_folderColumns.name.push_back(_strings.intern(std::move(name)));
+	_folderColumns.unreadCount.push_back(unreadCount);
+
+	return row(_folders, _folderColumns, _folderColumns.id.size() - 1);
+}
+
+std::vector<std::shared_ptr<Appointment>> EntityStore::appointments()
+{
+	return rows(_appointments, _appointmentColumns);
+}
+
+std::vector<std::shared_ptr<Task>> EntityStore::tasks()
+{
+	return rows(_tasks, _taskColumns);
+}
+
+std::vector<std::shared_ptr<Folder>> EntityStore::folders()
+{
+	return rows(_folders, _folderColumns);
+}
+
+template <class _Row, class _Columns>
+Page<_Row> EntityStore::page(std::deque<_Row>& rows, const _Columns& columns, NodeType type,
+	const PageWindow& window, const FieldMask& fields)
+{
+	const auto& ids = columns.id;
+	const auto [first, last] = pageRange(ids.size(),
+		window,
+		[this, &ids, type](std::string_view argument, const ItemCursor& cursor) {
+			std::optional<size_t> position;
+
+			// There is no delete path, so a cursor from this store is either still at its
+			// position or its ID isn't in the store, and only raw IDs have no collection.
+			if (!cursor.position || cursor.type == type)
+			{
+				const bool atPosition = cursor.version == _version && cursor.position
+					&& *cursor.position < ids.size()
+					&& GlobalId::key(ids[*cursor.position]) == GlobalId::key(cursor.id);
+
+				position = atPosition ? cursor.position : ids.find(cursor.id);
+			}
+
+			return cursorPosition(argument, position);
+		});
+	auto entries = std::make_shared<std::vector<std::shared_ptr<_Row>>>();
+
+	// Only create the row views on the page, and none if nobody selected the edges.
+	if (fields.edges)
+	{
+		entries->reserve(last - first);
+
+		for (auto position = first; position < last; ++position)
+		{
+			entries->push_back(row(rows, columns, position));
+		}
+	}
+
+	return {
+		entries,
+		typename Snapshot<_Row>::view_type(*entries),
+		_version,
+		first,
+		last < ids.size(),
+		first > 0,
+	};
+}
+
+Page<Appointment> EntityStore::appointmentPage(const PageWindow& window, const FieldMask& fields)
+{
+	return page(_appointments, _appointmentColumns, NodeType::Appointment, window, fields);
+}
+
+Page<Task> EntityStore::taskPage(const PageWindow& window, const FieldMask& fields)
+{
+	return page(_tasks, _taskColumns, NodeType::Task, window, fields);
+}
+
+Page<Folder> EntityStore::folderPage(const PageWindow& window, const FieldMask& fields)
+{
+	return page(_folders, _folderColumns, NodeType::Folder, window, fields);
+}
+
+// Each journal record is a 4 byte size of the rest of the record, a byte with the JournalFields
+// which are set, a byte for each of the fields, and then the task ID bytes.
+enum JournalFields : std::uint8_t
+{
+	JournalIsComplete = 0x1,
+	JournalState = 0x2,
+};
+
+constexpr size_t journalSizePrefix = sizeof(std::uint32_t);
+constexpr size_t journalFieldsSize = 3;
+
+void appendRecord(std::string& buffer, const Journal::Record& record)
+{
+	const auto size = static_cast<std::uint32_t>(journalFieldsSize + record.taskId.size());
+	const std::uint8_t fields = (record.isComplete ? JournalIsComplete : 0)
+		| (record.state ? JournalState : 0);
+
+	buffer.append(reinterpret_cast<const char*>(&size), sizeof(size));
+	buffer.push_back(static_cast<char>(fields));
+	buffer.push_back(static_cast<char>(record.isComplete.value_or(false) ? 1 : 0));
+	buffer.push_back(static_cast<char>(record.state.value_or(TaskState::New)));
+	buffer.append(reinterpret_cast<const char*>(record.taskId.data()), record.taskId.size());
+}
+
+bool syncFile(std::FILE* file) noexcept
+{
+	if (std::fflush(file) != 0)
+	{
+		return false;
+	}
+
+#ifdef _WIN32
+	return _commit(_fileno(file)) == 0;
+#else
+	return fsync(fileno(file)) == 0;
+#endif
+}
+
+// Cuts the file back to size, e.g. to drop a batch which was only partly written.
+bool truncateFile(std::FILE* file, long size) noexcept
+{
+	std::clearerr(file);
+
+#ifdef _WIN32
+	return _chsize_s(_fileno(file), size) == 0 && _commit(_fileno(file)) == 0;
+#else
+	return ftruncate(fileno(file), size) == 0 && fsync(fileno(file)) == 0;
+#endif
+}
+
+Journal::Journal(std::shared_ptr<EntityStore> store, std::string dataset, size_t compactAfter)
+	: _store(std::move(store))
+	, _dataset(std::move(dataset))
+	, _path(_dataset + ".journal")
+	, _compactAfter(compactAfter)
+{
+	// A rotated journal is left behind if the last compaction didn't finish.
+	replay(_path + ".rotated");
+	replay(_path);
+
+	_file = std::fopen(_path.c_str(), "ab");
+
+	if (!_file)
+	{
+		throw std::runtime_error("Cannot open journal: " + _path);
+	}
+
+	_writer = std::thread([this]() {
+		write();
+	});
+}
+
+Journal::~Journal()
+{
+	{
+		std::lock_guard lock(_mutex);
+
+		_stopping = true;
+	}
+
+	_condition.notify_one();
+	_writer.join();
+
+	if (_compacting.valid())
+	{
+		_compacting.wait();
+	}
+
+	if (_file)
+	{
+		std::fclose(_file);
+	}
+}
+
+Eventual<std::shared_ptr<const TaskVersion>> Journal::append(Record&& record)
+{
+	Eventual<std::shared_ptr<const TaskVersion>> result;
+
+	{
+		std::lock_guard lock(_mutex);
+
+		_pending.emplace_back(std::move(record), result);
+	}
+
+	_condition.notify_one();
+
+	return result;
+}
+
+void Journal::replay(const std::string& path)
+{
+	std::ifstream in(path, std::ios::binary);
+
+	if (!in)
+	{
+		return;
+	}
+
+	const std::string bytes { std::istreambuf_iterator<char>(in),
+		std::istreambuf_iterator<char>() };
+	size_t offset = 0;
+
+	while (bytes.size() - offset >= journalSizePrefix)
+	{
+		std::uint32_t size = 0;
+
+		std::memcpy(&size, bytes.data() + offset, sizeof(size));
+
+		// Stop at a record which was torn by a crash in the middle of a write.
+		if (size < journalFieldsSize || bytes.size() - offset - journalSizePrefix < size)
+		{
+			break;
+		}
+
+		const auto record = reinterpret_cast<const std::uint8_t*>(bytes.data()) + offset
+			+ journalSizePrefix;
+		const auto fields = record[0];
+		const auto state = static_cast<TaskState>(record[2]);
+
+		// A complete record with a bad state is corrupt rather than torn, and the records after it
+		// may be fine, so refuse to start instead of truncating them.
+		if ((fields & JournalState) && !validTaskState(state))
+		{
+			throw std::runtime_error("Invalid journal task state: " + path);
+		}
+
+		_store->updateTask({ record + journalFieldsSize, size - journalFieldsSize },
+			(fields & JournalIsComplete) ? std::make_optional(record[1] != 0) : std::nullopt,
+			(fields & JournalState) ? std::make_optional(state) : std::nullopt);
+		offset += journalSizePrefix + size;
+	}
+
+	in.close();
+
+	if (offset < bytes.size())
+	{
+		std::filesystem::resize_file(path, offset);
+	}
+}
+
+void Journal::write()
+{
+	std::unique_lock lock(_mutex);
+
+	while (true)
+	{
+		_condition.wait(lock, [this]() noexcept {
+			return _stopping || !_pending.empty();
+		});
+
+		if (_pending.empty())
+		{
+			break;
+		}
+
+		// Group commit everything which was appended while the last batch was flushing.
+		auto batch = std::exchange(_pending, {});
+
+		lock.unlock();
+
+		std::string buffer;
+
+		for (const auto& entry : batch)
+		{
+			appendRecord(buffer, entry.first);
+		}
+
+		const auto start =
+			_file && std::fseek(_file, 0, SEEK_END) == 0 ? std::ftell(_file) : -1L;
+		const bool written = start >= 0
+			&& std::fwrite(buffer.data(), 1, buffer.size(), _file) == buffer.size()
+			&& syncFile(_file);
+
+		// Remove whatever part of a failed batch reached the file, so it isn't replayed, and so
+		// the next batch doesn't follow a torn record. If that fails too, the journal can't be
+		// trusted any more and every later append fails.
+		if (_file && !written && (start < 0 || !truncateFile(_file, start)))
+		{
+			std::cerr << "Cannot recover the journal: " << _path << std::endl;
+			std::fclose(_file);
+			_file = nullptr;
+		}
+
+		for (auto& entry : batch)
+		{
+			if (written)
+			{
+				try
+				{
+					entry.second.set_value(_store->updateTask(entry.first.taskId,
+						entry.first.isComplete,
+						entry.first.state));
+				}
+				catch (...)
+				{
+					entry.second.set_exception(std::current_exception());
+				}
+			}
+			else
+			{
+				entry.second.set_exception(std::make_exception_ptr(
+					std::runtime_error("Cannot write journal: " + _path)));
+			}
+		}
+
+		_records += batch.size();
+
+		const bool compacting = _compacting.valid()
+			&& _compacting.wait_for(std::chrono::seconds(0)) != std::future_status::ready;
+		std::string rotatedPath = _path + ".rotated";
+		std::error_code ec;
+
+		// Rotating only takes a rename, the compactor writes the dataset in the background. If
+		// the last compaction failed the rotated journal is still there, so keep appending.
+		if (written && _records >= _compactAfter && !compacting
+			&& !std::filesystem::exists(rotatedPath, ec))
+		{
+			std::fclose(_file);
+			std::filesystem::rename(_path, rotatedPath, ec);
+			_file = std::fopen(_path.c_str(), "ab");
+
+			if (!_file)
+			{
+				std::cerr << "Cannot reopen the journal: " << _path << std::endl;
+			}
+
+			if (!ec)
+			{
+				_records = 0;
+				_compacting = std::async(std::launch::async,
+					&Journal::compact,
+					this,
+					std::move(rotatedPath));
+			}
+		}
+
+		lock.lock();
+	}
+}
+
+void Journal::compact(std::string rotatedPath)
+{
+	try
+	{
+		// The store already has every record in the rotated journal, and replaying a record
+		// which is also in the new dataset is harmless. save only returns once the new dataset
+		// and its rename are durable, so the rotated journal is no longer needed after that.
+		_store->save(_dataset);
+
+		std::error_code ec;
+
+		std::filesystem::remove(rotatedPath, ec);
+	}
+	catch (const std::exception& ex)
+	{
+		// On Windows the dataset can't be replaced while it's mapped, so the rotated journal
+		// is replayed on the next start instead.
+		std::cerr << "Caught exception compacting the journal: " << ex.what() << std::endl;
+	}
+}
+
+Query::Query(appointmentsLoader&& getAppointments, tasksLoader&& getTasks,
+	unreadCountsLoader&& getUnreadCounts, PageLoaders&& pageLoaders)
+	: _getAppointments(std::move(getAppointments))
+	, _getTasks(std::move(getTasks))
+	, _getUnreadCounts(getUnreadCounts)
+	, _pageLoaders(std::move(pageLoaders))
+	, _appointments(std::make_shared<const Snapshot<Appointment>>())
+	, _tasks(std::make_shared<const Snapshot<Task>>())
+	, _unreadCounts(std::make_shared<const Snapshot<Folder>>())
+{
+}
+
+std::shared_ptr<const Snapshot<Appointment>> Query::loadAppointments(
+	const std::shared_ptr<service::RequestState>& state)
+{
+	auto fieldMask = requestedFields(state);
+	auto snapshot = _appointments.load();
+
+	if (!_getAppointments || (snapshot->fields && snapshot->fields->covers(fieldMask)))
+	{
+		return snapshot;
+	}
+
+	// Only requests which need to reload wait for each other.
+	std::lock_guard lock(_loadMutex);
 
-namespace graphql::today {
+	snapshot = _appointments.load();
 
-Appointment::Appointment(
-	response::IdType&& id, std::string&& when, std::string&& subject, bool isNow)
-	: _id(std::move(id))
-	, _when(std::make_shared<response::Value>(std::move(when)))
-	, _subject(std::make_shared<response::Value>(std::move(subject)))
-	, _isNow(isNow)
-{
-}
+	if (snapshot->fields && snapshot->fields->covers(fieldMask))
+	{
+		return snapshot;
+	}
 
-Task::Task(response::IdType&& id, std::string&& title, bool isComplete)
-	: _id(std::move(id))
-	, _title(std::make_shared<response::Value>(std::move(title)))
-	, _isComplete(isComplete)
-{
+	if (state)
+	{
+		auto todayState = std::static_pointer_cast<RequestState>(state);
+
+		todayState->appointmentsRequestId = todayState->requestId;
+		todayState->loadAppointmentsCount++;
+	}
+
+	// Keep the fields from the last load, so requests don't keep swapping the snapshot.
+	if (snapshot->fields)
+	{
+		fieldMask |= *snapshot->fields;
+	}
+
+	IdOrder order;
+	auto entries = _getAppointments(fieldMask, order);
+
+	snapshot = std::make_shared<const Snapshot<Appointment>>(std::move(entries), fieldMask, order);
+	_appointments.store(snapshot);
+
+	return snapshot;
 }
 
-Folder::Folder(response::IdType&& id, std::string&& name, int unreadCount)
-	: _id(std::move(id))
-	, _name(std::make_shared<response::Value>(std::move(name)))
-	, _unreadCount(unreadCount)
+std::shared_ptr<const Snapshot<Task>> Query::loadTasks(
+	const std::shared_ptr<service::RequestState>& state)
 {
+	auto fieldMask = requestedFields(state);
+	auto snapshot = _tasks.load();
+
+	if (!_getTasks || (snapshot->fields && snapshot->fields->covers(fieldMask)))
+	{
+		return snapshot;
+	}
+
+	// Only requests which need to reload wait for each other.
+	std::lock_guard lock(_loadMutex);
+
+	snapshot = _tasks.load();
+
+	if (snapshot->fields && snapshot->fields->covers(fieldMask))
+	{
+		return snapshot;
+	}
+
+	if (state)
+	{
+		auto todayState = std::static_pointer_cast<RequestState>(state);
+
+		todayState->tasksRequestId = todayState->requestId;
+		todayState->loadTasksCount++;
+	}
+
+	// Keep the fields from the last load, so requests don't keep swapping the snapshot.
+	if (snapshot->fields)
+	{
+		fieldMask |= *snapshot->fields;
+	}
+
+	IdOrder order;
+	auto entries = _getTasks(fieldMask, order);
+
+	snapshot = std::make_shared<const Snapshot<Task>>(std::move(entries), fieldMask, order);
+	_tasks.store(snapshot);
+
+	return snapshot;
 }
 
-Query::Query(appointmentsLoader&& getAppointments, tasksLoader&& getTasks,
-	unreadCountsLoader&& getUnreadCounts)
-	: _getAppointments(std::move(getAppointments))
-	, _getTasks(std::move(getTasks))
-	, _getUnreadCounts(getUnreadCounts)
+std::shared_ptr<const Snapshot<Folder>> Query::loadUnreadCounts(
+	const std::shared_ptr<service::RequestState>& state)
 {
+	auto fieldMask = requestedFields(state);
+	auto snapshot = _unreadCounts.load();
+
+	if (!_getUnreadCounts || (snapshot->fields && snapshot->fields->covers(fieldMask)))
+	{
+		return snapshot;
+	}
+
+	// Only requests which need to reload wait for each other.
+	std::lock_guard lock(_loadMutex);
+
+	snapshot = _unreadCounts.load();
+
+	if (snapshot->fields && snapshot->fields->covers(fieldMask))
+	{
+		return snapshot;
+	}
+
+	if (state)
+	{
+		auto todayState = std::static_pointer_cast<RequestState>(state);
+
+		todayState->unreadCountsRequestId = todayState->requestId;
+		todayState->loadUnreadCountsCount++;
+	}
+
+	// Keep the fields from the last load, so requests don't keep swapping the snapshot.
+	if (snapshot->fields)
+	{
+		fieldMask |= *snapshot->fields;
+	}
+
+	IdOrder order;
+	auto entries = _getUnreadCounts(fieldMask, order);
+
+	snapshot = std::make_shared<const Snapshot<Folder>>(std::move(entries), fieldMask, order);
+	_unreadCounts.store(snapshot);
+
+	return snapshot;
 }
 
-void Query::loadAppointments(const std::shared_ptr<service::RequestState>& state)
+template <class _Object>
+void Query::findInSnapshot(NodeType type, const Snapshot<_Object>& snapshot,
+	std::vector<BatchLoader::Request>& requests) noexcept
 {
-	if (_getAppointments)
+	for (auto& request : requests)
 	{
-		if (state)
+		if (request.entity.index() != 0
+			|| (request.type != NodeType::Unknown && request.type != type))
 		{
-			auto todayState = std::static_pointer_cast<RequestState>(state);
+			continue;
+		}
+
+		const auto idType = GlobalId::decode(request.id);
 
-			todayState->appointmentsRequestId = todayState->requestId;
-			todayState->loadAppointmentsCount++;
+		if (idType != NodeType::Unknown && idType != type)
+		{
+			continue;
 		}
 
-		_appointments = _getAppointments();
-		_getAppointments = nullptr;
+		const auto position = snapshot.find(request.id);
+
+		if (position)
+		{
+			request.entity = snapshot.entries[*position];
+		}
 	}
 }
 
-std::shared_ptr<Appointment> Query::findAppointment(
-	const service::FieldParams& params, const response::IdType& id)
+void Query::fetchEntities(const std::shared_ptr<service::RequestState>& state,
+	std::vector<BatchLoader::Request>& requests)
 {
-	loadAppointments(params.state);
+	if (state)
+	{
+		std::static_pointer_cast<RequestState>(state)->fetchEntitiesCount++;
+	}
 
-	for (const auto& appointment : _appointments)
+	const auto wants = [&requests](NodeType type) noexcept {
+		return std::any_of(requests.cbegin(),
+			requests.cend(),
+			[type](const BatchLoader::Request& request) noexcept {
+				return request.entity.index() == 0
+					&& (request.type == NodeType::Unknown || request.type == type);
+			});
+	};
+
+	// Each collection is loaded and probed at most once for the whole batch.
+	if (wants(NodeType::Appointment))
 	{
-		if (appointment->id() == id)
-		{
-			return appointment;
-		}
+		findInSnapshot(NodeType::Appointment, *loadAppointments(state), requests);
 	}
 
-	return nullptr;
+	if (wants(NodeType::Task))
+	{
+		findInSnapshot(NodeType::Task, *loadTasks(state), requests);
+	}
+
+	if (wants(NodeType::Folder))
+	{
+		findInSnapshot(NodeType::Folder, *loadUnreadCounts(state), requests);
+	}
 }
 
-void Query::loadTasks(const std::shared_ptr<service::RequestState>& state)
+Eventual<NodeEntity> Query::loadEntity(
+	const service::FieldParams& params, NodeType type, const response::IdType& id)
 {
-	if (_getTasks)
+	if (params.state)
 	{
-		if (state)
-		{
-			auto todayState = std::static_pointer_cast<RequestState>(state);
+		auto todayState = std::static_pointer_cast<RequestState>(params.state);
+		auto batched = todayState->batchLoader.load(type, id);
 
-			todayState->tasksRequestId = todayState->requestId;
-			todayState->loadTasksCount++;
+		if (batched)
+		{
+			return std::move(*batched);
 		}
+	}
+
+	std::vector<BatchLoader::Request> requests(1);
+
+	requests.front().type = type;
+	requests.front().id = id;
+	fetchEntities(params.state, requests);
+
+	return Eventual<NodeEntity> { std::move(requests.front().entity) };
+}
+
+void Query::beginSelectionSet(const service::SelectionSetParams& params)
+{
+	if (params.state)
+	{
+		auto todayState = std::static_pointer_cast<RequestState>(params.state);
 
-		_tasks = _getTasks();
-		_getTasks = nullptr;
+		todayState->batchLoader.beginSelectionSet();
 	}
 }
 
-std::shared_ptr<Task> Query::findTask(
-	const service::FieldParams& params, const response::IdType& id)
+void Query::endSelectionSet(const service::SelectionSetParams& params)
 {
-	loadTasks(params.state);
+	if (!params.state)
+	{
+		return;
+	}
+
+	auto todayState = std::static_pointer_cast<RequestState>(params.state);
+	auto requests = todayState->batchLoader.endSelectionSet();
+
+	if (requests.empty())
+	{
+		return;
+	}
+
+	try
+	{
+		fetchEntities(params.state, requests);
 
-	for (const auto& task : _tasks)
+		for (auto& request : requests)
+		{
+			request.result.set_value(std::move(request.entity));
+		}
+	}
+	catch (...)
 	{
-		if (task->id() == id)
+		for (auto& request : requests)
 		{
-			return task;
+			request.result.set_exception(std::current_exception());
 		}
 	}
+}
 
-	return nullptr;
+std::shared_ptr<object::Appointment> Query::wrap(const std::shared_ptr<Appointment>& entity) const
+{
+	return _appointments.load()->wrap(entity);
+}
+
+std::shared_ptr<object::Task> Query::wrap(const std::shared_ptr<Task>& entity) const
+{
+	return _tasks.load()->wrap(entity);
 }
 
-void Query::loadUnreadCounts(const std::shared_ptr<service::RequestState>& state)
+std::shared_ptr<object::Folder> Query::wrap(const std::shared_ptr<Folder>& entity) const
 {
-	if (_getUnreadCounts)
+	return _unreadCounts.load()->wrap(entity);
+}
+
+// Fixed pool of threads which resume the suspended Query coroutines, either after a delay or once
+// an Eventual is set, so each co_await doesn't start a thread of its own. Nothing in the pool ever
+// waits, each task just resumes a coroutine.
+class ResumePool
+{
+public:
+	using clock = std::chrono::steady_clock;
+
+	static ResumePool& instance()
 	{
-		if (state)
-		{
-			auto todayState = std::static_pointer_cast<RequestState>(state);
+		static ResumePool pool;
 
-			todayState->unreadCountsRequestId = todayState->requestId;
-			todayState->loadUnreadCountsCount++;
-		}
+		return pool;
+	}
 
-		_unreadCounts = _getUnreadCounts();
-		_getUnreadCounts = nullptr;
+	void schedule(clock::time_point when, std::function<void()>&& task)
+	{
+		std::unique_lock lock(_mutex);
+
+		_tasks.emplace(when, std::move(task));
+		lock.unlock();
+		_condition.notify_one();
 	}
-}
 
-std::shared_ptr<Folder> Query::findUnreadCount(
-	const service::FieldParams& params, const response::IdType& id)
-{
-	loadUnreadCounts(params.state);
+private:
+	ResumePool()
+	{
+		const size_t count = std::max(2u, std::thread::hardware_concurrency());
+
+		_threads.reserve(count);
+
+		for (size_t i = 0; i < count; ++i)
+		{
+			_threads.emplace_back([this]() noexcept {
+				run();
+			});
+		}
+	}
 
-	for (const auto& folder : _unreadCounts)
+	~ResumePool()
 	{
-		if (folder->id() == id)
+		std::unique_lock lock(_mutex);
+
+		_stopping = true;
+		lock.unlock();
+		_condition.notify_all();
+
+		for (auto& thread : _threads)
 		{
-			return folder;
+			thread.join();
 		}
 	}
 
-	return nullptr;
-}
+	void run() noexcept
+	{
+		std::unique_lock lock(_mutex);
+
+		while (!_stopping)
+		{
+			if (_tasks.empty())
+			{
+				_condition.wait(lock);
+				continue;
+			}
+
+			const auto itr = _tasks.begin();
 
+			if (itr->first > clock::now())
+			{
+				_condition.wait_until(lock, itr->first);
+				continue;
+			}
+
+			auto task = std::move(itr->second);
+
+			_tasks.erase(itr);
+			lock.unlock();
+			task();
+			lock.lock();
+		}
+	}
+
+	std::mutex _mutex;
+	std::condition_variable _condition;
+	std::multimap<clock::time_point, std::function<void()>> _tasks;
+	bool _stopping = false;
+	std::vector<std::thread> _threads;
+};
+
+// The generated resolvers hold the object's _resolverMutex until the coroutine suspends, so wait
+// in the ResumePool rather than sleeping through every other request's call into the same Query.
 template <class _Rep, class _Period>
 auto operator co_await(std::chrono::duration<_Rep, _Period> delay)
 {
@@ -155,149 +2034,143 @@ auto operator co_await(std::chrono::duration<_Rep, _Period> delay)
 	{
 		const std::chrono::duration<_Rep, _Period> delay;
 
-		constexpr bool await_ready() const
+		bool await_ready() const
 		{
-			return true;
+			return delay <= delay.zero();
 		}
 
-		void await_suspend(coro::coroutine_handle<> h) noexcept
+		void await_suspend(coro::coroutine_handle<> h) const
 		{
-			h.resume();
+			ResumePool::instance().schedule(
+				ResumePool::clock::now()
+					+ std::chrono::duration_cast<ResumePool::clock::duration>(delay),
+				[h]() noexcept {
+					h.resume();
+				});
 		}
 
-		void await_resume()
+		constexpr void await_resume() const noexcept
 		{
-			std::this_thread::sleep_for(delay);
 		}
 	};
 
 	return awaiter { delay };
 }
 
+void resumeLater(coro::coroutine_handle<> h)
+{
+	ResumePool::instance().schedule(ResumePool::clock::now(), [h]() noexcept {
+		h.resume();
+	});
+}
+
 service::AwaitableObject<std::shared_ptr<object::Node>> Query::getNode(
 	service::FieldParams params, response::IdType id)
 {
 	// query { node(id: "ZmFrZVRhc2tJZA==") { ...on Task { title } } }
 	using namespace std::literals;
-	co_await 100ms;
 
-	auto appointment = findAppointment(params, id);
+	// Keep the Query alive while we're suspended.
+	const auto spThis = shared_from_this();
 
-	if (appointment)
-	{
-		co_return std::make_shared<object::Node>(
-			std::make_shared<object::Appointment>(std::move(appointment)));
-	}
+	// Queue the lookup before the first suspension, so it joins the batch for this selection set.
+	// Global IDs only probe their own collection, raw IDs probe each of them in turn.
+	auto pending = loadEntity(params, GlobalId::decode(id), id);
 
-	auto task = findTask(params, id);
+	co_await 100ms;
+
+	auto entity = co_await std::move(pending);
 
-	if (task)
+	switch (entity.index())
 	{
-		co_return std::make_shared<object::Node>(std::make_shared<object::Task>(std::move(task)));
-	}
+		case 1:
+			co_return std::make_shared<object::Node>(loadAppointments(params.state)->wrap(
+				std::get<std::shared_ptr<Appointment>>(entity)));
 
-	auto folder = findUnreadCount(params, id);
+		case 2:
+			co_return std::make_shared<object::Node>(
+				loadTasks(params.state)->wrap(std::get<std::shared_ptr<Task>>(entity)));
 
-	if (folder)
-	{
-		co_return std::make_shared<object::Node>(
-			std::make_shared<object::Folder>(std::move(folder)));
+		case 3:
+			co_return std::make_shared<object::Node>(
+				loadUnreadCounts(params.state)->wrap(std::get<std::shared_ptr<Folder>>(entity)));
+
+		default:
+			break;
 	}
 
 	co_return nullptr;
 }
 
-template <class _Object, class _Connection>
-struct EdgeConstraints
+// Validates the pagination arguments and decodes the cursors for the page loaders.
+PageWindow makePageWindow(std::optional<int>&& first, std::optional<response::Value>&& after,
+	std::optional<int>&& last, std::optional<response::Value>&& before)
 {
-	using vec_type = std::vector<std::shared_ptr<_Object>>;
-	using itr_type = typename vec_type::const_iterator;
-
-	EdgeConstraints(const std::shared_ptr<service::RequestState>& state, const vec_type& objects)
-		: _state(state)
-		, _objects(objects)
+	if (first && *first < 0)
 	{
+		std::ostringstream error;
+
+		error << "Invalid argument: first value: " << *first;
+		throw service::schema_exception { { service::schema_error { error.str() } } };
 	}
 
-	std::shared_ptr<_Connection> operator()(const std::optional<int>& first,
-		std::optional<response::Value>&& after, const std::optional<int>& last,
-		std::optional<response::Value>&& before) const
+	if (last && *last < 0)
 	{
-		auto itrFirst = _objects.cbegin();
-		auto itrLast = _objects.cend();
-
-		if (after)
-		{
-			auto afterId = after->release<response::IdType>();
-			auto itrAfter =
-				std::find_if(itrFirst, itrLast, [&afterId](const std::shared_ptr<_Object>& entry) {
-					return entry->id() == afterId;
-				});
-
-			if (itrAfter != itrLast)
-			{
-				itrFirst = itrAfter;
-			}
-		}
-
-		if (before)
-		{
-			auto beforeId = before->release<response::IdType>();
-			auto itrBefore =
-				std::find_if(itrFirst, itrLast, [&beforeId](const std::shared_ptr<_Object>& entry) {
-					return entry->id() == beforeId;
-				});
-
-			if (itrBefore != itrLast)
-			{
-				itrLast = itrBefore;
-				++itrLast;
-			}
-		}
-
-		if (first)
-		{
-			if (*first < 0)
-			{
-				std::ostringstream error;
+		std::ostringstream error;
 
-				error << "Invalid argument: first value: " << *first;
-				throw service::schema_exception { { service::schema_error { error.str() } } };
-			}
+		error << "Invalid argument: last value: " << *last;
+		throw service::schema_exception { { service::schema_error { error.str() } } };
+	}
 
-			if (itrLast - itrFirst > *first)
-			{
-				itrLast = itrFirst + *first;
-			}
-		}
+	PageWindow window { std::move(first), std::nullopt, std::move(last), std::nullopt };
 
-		if (last)
-		{
-			if (*last < 0)
-			{
-				std::ostringstream error;
+	if (after)
+	{
+		window.after = std::make_optional(ItemCursor::decode(after->release<response::IdType>()));
+	}
 
-				error << "Invalid argument: last value: " << *last;
-				throw service::schema_exception { { service::schema_error { error.str() } } };
-			}
+	if (before)
+	{
+		window.before =
+			std::make_optional(ItemCursor::decode(before->release<response::IdType>()));
+	}
 
-			if (itrLast - itrFirst > *last)
-			{
-				itrFirst = itrLast - *last;
-			}
-		}
+	return window;
+}
 
-		std::vector<std::shared_ptr<_Object>> edges(itrLast - itrFirst);
+// Pages through a whole Snapshot when there is no page loader for the connection.
+template <class _Object>
+struct EdgeConstraints
+{
+	using snapshot_type = std::shared_ptr<const Snapshot<_Object>>;
 
-		std::copy(itrFirst, itrLast, edges.begin());
+	explicit EdgeConstraints(snapshot_type snapshot)
+		: _snapshot(std::move(snapshot))
+	{
+	}
 
-		return std::make_shared<_Connection>(itrLast<_objects.cend(), itrFirst> _objects.cbegin(),
-			std::move(edges));
+	Page<_Object> operator()(const PageWindow& window) const
+	{
+		const auto& objects = _snapshot->entries;
+		const auto [itrFirst, itrLast] = pageRange(objects.size(),
+			window,
+			[this](std::string_view argument, const ItemCursor& cursor) {
+				return cursorPosition(argument, _snapshot->seek(cursor));
+			});
+
+		return {
+			std::shared_ptr<const typename Snapshot<_Object>::vec_type>(_snapshot, &objects),
+			typename Snapshot<_Object>::view_type(objects.data() + itrFirst, itrLast - itrFirst),
+			_snapshot->version,
+			itrFirst,
+			itrLast < objects.size(),
+			itrFirst > 0,
+			_snapshot,
+		};
 	}
 
 private:
-	const std::shared_ptr<service::RequestState>& _state;
-	const vec_type& _objects;
+	const snapshot_type _snapshot;
 };
 
 std::future<std::shared_ptr<object::AppointmentConnection>> Query::getAppointments(
@@ -313,15 +2186,25 @@ std::future<std::shared_ptr<object::AppointmentConnection>> Query::getAppointmen
 			std::optional<response::Value>&& afterWrapped,
 			std::optional<int>&& lastWrapped,
 			std::optional<response::Value>&& beforeWrapped) {
-			loadAppointments(state);
-
-			EdgeConstraints<Appointment, AppointmentConnection> constraints(state, _appointments);
-			auto connection = constraints(firstWrapped,
+			auto window = makePageWindow(std::move(firstWrapped),
 				std::move(afterWrapped),
-				lastWrapped,
+				std::move(lastWrapped),
 				std::move(beforeWrapped));
+			Page<Appointment> page;
+
+			if (_pageLoaders.appointments)
+			{
+				page = _pageLoaders.appointments(window, requestedFields(state));
+			}
+			else
+			{
+				page = EdgeConstraints<Appointment>(loadAppointments(state))(window);
+			}
 
-			return std::make_shared<object::AppointmentConnection>(connection);
+			const auto arena = requestArena(state);
+
+			return allocateShared<object::AppointmentConnection>(arena,
+				allocateShared<AppointmentConnection>(arena, std::move(page), arena));
 		},
 		std::move(first),
 		std::move(after),
@@ -342,15 +2225,25 @@ std::future<std::shared_ptr<object::TaskConnection>> Query::getTasks(
 			std::optional<response::Value>&& afterWrapped,
 			std::optional<int>&& lastWrapped,
 			std::optional<response::Value>&& beforeWrapped) {
-			loadTasks(state);
-
-			EdgeConstraints<Task, TaskConnection> constraints(state, _tasks);
-			auto connection = constraints(firstWrapped,
+			auto window = makePageWindow(std::move(firstWrapped),
 				std::move(afterWrapped),
-				lastWrapped,
+				std::move(lastWrapped),
 				std::move(beforeWrapped));
+			Page<Task> page;
+
+			if (_pageLoaders.tasks)
+			{
+				page = _pageLoaders.tasks(window, requestedFields(state));
+			}
+			else
+			{
+				page = EdgeConstraints<Task>(loadTasks(state))(window);
+			}
+
+			const auto arena = requestArena(state);
 
-			return std::make_shared<object::TaskConnection>(connection);
+			return allocateShared<object::TaskConnection>(arena,
+				allocateShared<TaskConnection>(arena, std::move(page), arena));
 		},
 		std::move(first),
 		std::move(after),
@@ -371,15 +2264,25 @@ std::future<std::shared_ptr<object::FolderConnection>> Query::getUnreadCounts(
 			std::optional<response::Value>&& afterWrapped,
 			std::optional<int>&& lastWrapped,
 			std::optional<response::Value>&& beforeWrapped) {
-			loadUnreadCounts(state);
-
-			EdgeConstraints<Folder, FolderConnection> constraints(state, _unreadCounts);
-			auto connection = constraints(firstWrapped,
+			auto window = makePageWindow(std::move(firstWrapped),
 				std::move(afterWrapped),
-				lastWrapped,
+				std::move(lastWrapped),
 				std::move(beforeWrapped));
+			Page<Folder> page;
+
+			if (_pageLoaders.unreadCounts)
+			{
+				page = _pageLoaders.unreadCounts(window, requestedFields(state));
+			}
+			else
+			{
+				page = EdgeConstraints<Folder>(loadUnreadCounts(state))(window);
+			}
 
-			return std::make_shared<object::FolderConnection>(connection);
+			const auto arena = requestArena(state);
+
+			return allocateShared<object::FolderConnection>(arena,
+				allocateShared<FolderConnection>(arena, std::move(page), arena));
 		},
 		std::move(first),
 		std::move(after),
@@ -387,49 +2290,109 @@ std::future<std::shared_ptr<object::FolderConnection>> Query::getUnreadCounts(
 		std::move(before));
 }
 
-std::vector<std::shared_ptr<object::Appointment>> Query::getAppointmentsById(
-	const service::FieldParams& params, const std::vector<response::IdType>& ids)
+service::AwaitableObject<std::vector<std::shared_ptr<object::Appointment>>>
+Query::getAppointmentsById(service::FieldParams params, std::vector<response::IdType> ids)
 {
-	std::vector<std::shared_ptr<object::Appointment>> result(ids.size());
+	// Keep the Query alive while we're suspended.
+	const auto spThis = shared_from_this();
+	std::vector<Eventual<NodeEntity>> entities(ids.size());
 
 	std::transform(ids.cbegin(),
 		ids.cend(),
-		result.begin(),
+		entities.begin(),
 		[this, &params](const response::IdType& id) {
-			return std::make_shared<object::Appointment>(findAppointment(params, id));
+			return loadEntity(params, NodeType::Appointment, id);
 		});
 
-	return result;
+	std::vector<std::shared_ptr<object::Appointment>> result(entities.size());
+	std::shared_ptr<const Snapshot<Appointment>> appointments;
+
+	for (size_t i = 0; i < entities.size(); ++i)
+	{
+		auto entity = co_await entities[i];
+
+		if (auto appointment = std::get_if<std::shared_ptr<Appointment>>(&entity))
+		{
+			if (!appointments)
+			{
+				appointments = loadAppointments(params.state);
+			}
+
+			result[i] = appointments->wrap(*appointment);
+		}
+	}
+
+	co_return result;
 }
 
-std::vector<std::shared_ptr<object::Task>> Query::getTasksById(
-	const service::FieldParams& params, const std::vector<response::IdType>& ids)
+service::AwaitableObject<std::vector<std::shared_ptr<object::Task>>> Query::getTasksById(
+	service::FieldParams params, std::vector<response::IdType> ids)
 {
-	std::vector<std::shared_ptr<object::Task>> result(ids.size());
+	// Keep the Query alive while we're suspended.
+	const auto spThis = shared_from_this();
+	std::vector<Eventual<NodeEntity>> entities(ids.size());
 
 	std::transform(ids.cbegin(),
 		ids.cend(),
-		result.begin(),
+		entities.begin(),
 		[this, &params](const response::IdType& id) {
-			return std::make_shared<object::Task>(findTask(params, id));
+			return loadEntity(params, NodeType::Task, id);
 		});
 
-	return result;
+	std::vector<std::shared_ptr<object::Task>> result(entities.size());
+	std::shared_ptr<const Snapshot<Task>> tasks;
+
+	for (size_t i = 0; i < entities.size(); ++i)
+	{
+		auto entity = co_await entities[i];
+
+		if (auto task = std::get_if<std::shared_ptr<Task>>(&entity))
+		{
+			if (!tasks)
+			{
+				tasks = loadTasks(params.state);
+			}
+
+			result[i] = tasks->wrap(*task);
+		}
+	}
+
+	co_return result;
 }
 
-std::vector<std::shared_ptr<object::Folder>> Query::getUnreadCountsById(
-	const service::FieldParams& params, const std::vector<response::IdType>& ids)
+service::AwaitableObject<std::vector<std::shared_ptr<object::Folder>>> Query::getUnreadCountsById(
+	service::FieldParams params, std::vector<response::IdType> ids)
 {
-	std::vector<std::shared_ptr<object::Folder>> result(ids.size());
+	// Keep the Query alive while we're suspended.
+	const auto spThis = shared_from_this();
+	std::vector<Eventual<NodeEntity>> entities(ids.size());
 
 	std::transform(ids.cbegin(),
 		ids.cend(),
-		result.begin(),
+		entities.begin(),
 		[this, &params](const response::IdType& id) {
-			return std::make_shared<object::Folder>(findUnreadCount(params, id));
+			return loadEntity(params, NodeType::Folder, id);
 		});
 
-	return result;
+	std::vector<std::shared_ptr<object::Folder>> result(entities.size());
+	std::shared_ptr<const Snapshot<Folder>> folders;
+
+	for (size_t i = 0; i < entities.size(); ++i)
+	{
+		auto entity = co_await entities[i];
+
+		if (auto folder = std::get_if<std::shared_ptr<Folder>>(&entity))
+		{
+			if (!folders)
+			{
+				folders = loadUnreadCounts(params.state);
+			}
+
+			result[i] = folders->wrap(*folder);
+		}
+	}
+
+	co_return result;
 }
 
 std::shared_ptr<object::NestedType> Query::getNested(service::FieldParams&& params)
@@ -457,17 +2420,13 @@ TaskState Query::getTestTaskState()
 std::vector<std::shared_ptr<object::UnionType>> Query::getAnyType(
 	const service::FieldParams& params, const std::vector<response::IdType>&)
 {
-	loadAppointments(params.state);
+	const auto appointments = loadAppointments(params.state);
+	std::vector<std::shared_ptr<object::UnionType>> result(appointments->entries.size());
 
-	std::vector<std::shared_ptr<object::UnionType>> result(_appointments.size());
-
-	std::transform(_appointments.cbegin(),
-		_appointments.cend(),
-		result.begin(),
-		[](const auto& appointment) noexcept {
-			return std::make_shared<object::UnionType>(
-				std::make_shared<object::Appointment>(appointment));
-		});
+	for (size_t i = 0; i < result.size(); ++i)
+	{
+		result[i] = std::make_shared<object::UnionType>(appointments->wrap(i));
+	}
 
 	return result;
 }
@@ -477,10 +2436,27 @@ Mutation::Mutation(completeTaskMutation&& mutateCompleteTask)
 {
 }
 
-std::shared_ptr<object::CompleteTaskPayload> Mutation::applyCompleteTask(
-	CompleteTaskInput&& input) noexcept
+service::AwaitableObject<std::shared_ptr<object::CompleteTaskPayload>> Mutation::applyCompleteTask(
+	service::FieldParams params, CompleteTaskInput input)
 {
-	return std::make_shared<object::CompleteTaskPayload>(_mutateCompleteTask(std::move(input)));
+	auto payload = _mutateCompleteTask(std::move(input), params.state);
+
+	if (!payload)
+	{
+		throw service::schema_exception { { service::schema_error { "task not found" } } };
+	}
+
+	// Suspend until the update is durable, instead of blocking the thread which resolves it.
+	auto taskVersion = co_await payload->written();
+
+	// The payload reads the new state of the task.
+	if (params.state)
+	{
+		std::static_pointer_cast<RequestState>(params.state)->taskVersion.store(
+			std::move(taskVersion));
+	}
+
+	co_return std::make_shared<object::CompleteTaskPayload>(std::move(payload));
 }
 
 std::optional<double> Mutation::_setFloat = std::nullopt;
@@ -20,12 +20,405 @@
 #include "TaskEdgeObject.h"
 #include "TaskObject.h"
 
+#include <array>
 #include <atomic>
+#include <bit>
+#include <condition_variable>
+#include <cstdio>
+#include <deque>
+#include <future>
+#include <map>
 #include <memory>
+#include <memory_resource>
+#include <mutex>
+#include <optional>
+#include <span>
 #include <stack>
+#include <string_view>
+#include <thread>
+#include <unordered_set>
+#include <utility>
+#include <variant>
 
 namespace graphql::today {
 
+enum class NodeType : std::uint8_t
+{
+	Unknown,
+	Appointment,
+	Task,
+	Folder,
+};
+
+// Opt-in global IDs embed the NodeType in a 2 byte prefix, so Query::getNode can probe a single
+// collection. Raw IDs without the prefix are still accepted and probe every collection.
+struct GlobalId
+{
+	// 0xFE never appears in UTF-8, so it can't be the first byte of a text ID.
+	static constexpr std::uint8_t marker = 0xFE;
+	static constexpr size_t prefixSize = 2;
+
+	static response::IdType encode(NodeType type, const response::IdType& rawId);
+	static NodeType decode(std::span<const std::uint8_t> id) noexcept;
+
+	// Index key for the ID bytes without the type prefix, it points into the ID buffer.
+	static std::string_view key(std::span<const std::uint8_t> id) noexcept;
+};
+
+// Positions of the entities in a collection sorted by GlobalId::key, so an ID is found with a
+// binary search. Datasets store it in a section, so mapping one doesn't index every row.
+using IdOrder = std::span<const std::uint32_t>;
+
+// Opaque ItemCursor value with the collection, Snapshot version and position of an edge, followed
+// by the ID of its node. Raw IDs without the marker are still accepted as cursors, they decode
+// with NodeType::Unknown, version 0, which no Snapshot uses, and without a position.
+struct ItemCursor
+{
+	// 0xFD never appears in UTF-8, so it can't be the first byte of a text ID.
+	static constexpr std::uint8_t marker = 0xFD;
+	static constexpr size_t headerSize = 2 + 2 * sizeof(std::uint64_t);
+
+	static response::IdType encode(
+		NodeType type, size_t version, size_t position, std::span<const std::uint8_t> id);
+	static ItemCursor decode(response::IdType&& cursor);
+
+	NodeType type = NodeType::Unknown;
+	size_t version = 0;
+	std::optional<size_t> position;
+	response::IdType id;
+};
+
+// Pagination arguments pushed down to the page loaders, with the cursors already decoded.
+struct PageWindow
+{
+	std::optional<int> first;
+	std::optional<ItemCursor> after;
+	std::optional<int> last;
+	std::optional<ItemCursor> before;
+};
+
+// Fields selected anywhere in the operation document, so the loaders can skip the data nobody
+// asked for. It's a superset of what any one resolver needs, the default selects everything.
+struct FieldMask
+{
+	static FieldMask fromDocument(const peg::ast& query);
+
+	// True if everything selected in other is also selected here.
+	bool covers(const FieldMask& other) const noexcept;
+	FieldMask& operator|=(const FieldMask& other) noexcept;
+
+	bool edges = true;
+	bool when = true;
+	bool subject = true;
+	bool title = true;
+	bool name = true;
+};
+
+// The generated object type which wraps each entity, specialized below.
+template <class _Object>
+struct ObjectWrapper;
+
+// Immutable collection of entities and their IdOrder. Connections keep the Snapshot alive and
+// page through it with non-owning views, so a page is never copied.
+template <class _Object>
+struct Snapshot
+{
+	using vec_type = std::vector<std::shared_ptr<_Object>>;
+	using view_type = std::span<const std::shared_ptr<_Object>>;
+	using wrapper_type = typename ObjectWrapper<_Object>::type;
+
+	explicit Snapshot();
+	// The order comes from the store which owns the entities, if it doesn't match them it's sorted
+	// here instead.
+	explicit Snapshot(vec_type&& objects, const FieldMask& loadedFields, IdOrder order = {});
+
+	// Returns the position of the entity in entries, or std::nullopt if it isn't in this Snapshot.
+	std::optional<size_t> find(std::span<const std::uint8_t> id) const noexcept;
+
+	// Returns the position of an ItemCursor. Cursors from this version seek directly to their
+	// position if the ID there still matches, others fall back to the ID. Only cursors from an
+	// earlier version of this collection fall back to the old position if the node has since been
+	// deleted. Returns std::nullopt if the cursor is not valid for this collection.
+	std::optional<size_t> seek(const ItemCursor& cursor) const noexcept;
+
+	// Identity map of the object wrappers for entries. Each one is created the first time it's
+	// resolved, and every later request which resolves the same entry from this Snapshot shares it.
+	std::shared_ptr<wrapper_type> wrap(size_t position) const;
+
+	// Wraps an entity which may have come from an older Snapshot, it only shares the wrapper if the
+	// entity is still in this one.
+	std::shared_ptr<wrapper_type> wrap(const std::shared_ptr<_Object>& entity) const;
+
+	const size_t version;
+	const vec_type entries;
+
+	// Fields the loader was asked for, or std::nullopt if nothing has been loaded yet.
+	const std::optional<FieldMask> fields;
+
+private:
+	const std::vector<std::uint32_t> _sorted;
+	const IdOrder _order;
+	const std::unique_ptr<std::atomic<std::shared_ptr<wrapper_type>>[]> _wrappers;
+};
+
+// Slice of a collection returned by a page loader. The page is a view over entries, which keeps
+// the nodes alive, and the ItemCursor of each edge encodes the version and offset of the page.
+template <class _Object>
+struct Page
+{
+	std::shared_ptr<const typename Snapshot<_Object>::vec_type> entries;
+	typename Snapshot<_Object>::view_type page;
+	size_t version = 0;
+	size_t offset = 0;
+	bool hasNextPage = false;
+	bool hasPreviousPage = false;
+
+	// Set if the page is a slice of a Snapshot, so the edges can share its wrappers.
+	std::shared_ptr<const Snapshot<_Object>> snapshot {};
+};
+
+class Appointment;
+class Task;
+class Folder;
+class Expensive;
+struct TaskVersion;
+
+template <>
+struct ObjectWrapper<Appointment>
+{
+	using type = object::Appointment;
+	static constexpr NodeType nodeType = NodeType::Appointment;
+};
+
+template <>
+struct ObjectWrapper<Task>
+{
+	using type = object::Task;
+	static constexpr NodeType nodeType = NodeType::Task;
+};
+
+template <>
+struct ObjectWrapper<Folder>
+{
+	using type = object::Folder;
+	static constexpr NodeType nodeType = NodeType::Folder;
+};
+
+// Entity found by Query::fetchEntities, std::monostate if the ID wasn't found.
+using NodeEntity = std::variant<std::monostate, std::shared_ptr<Appointment>,
+	std::shared_ptr<Task>, std::shared_ptr<Folder>>;
+
+// Resumes a suspended coroutine on one of the threads shared by every Query coroutine.
+void resumeLater(coro::coroutine_handle<> h);
+
+// Result which is set once by its producer, every copy shares it. A coroutine which co_awaits it
+// before then is resumed with resumeLater once it's set, so nothing blocks a thread waiting on it.
+template <class _Type>
+class Eventual
+{
+public:
+	Eventual()
+		: _state(std::make_shared<State>())
+	{
+	}
+
+	explicit Eventual(_Type value)
+		: Eventual()
+	{
+		_state->value = std::move(value);
+		_state->ready = true;
+	}
+
+	void set_value(_Type value)
+	{
+		settle([&value](State& state) {
+			state.value = std::move(value);
+		});
+	}
+
+	void set_exception(std::exception_ptr error)
+	{
+		settle([&error](State& state) {
+			state.error = std::move(error);
+		});
+	}
+
+	bool await_ready() const
+	{
+		std::lock_guard lock(_state->mutex);
+
+		return _state->ready;
+	}
+
+	// Returns false without suspending if the result was set in the meantime.
+	bool await_suspend(coro::coroutine_handle<> h) const
+	{
+		std::lock_guard lock(_state->mutex);
+
+		if (_state->ready)
+		{
+			return false;
+		}
+
+		_state->waiting.push_back(h);
+		return true;
+	}
+
+	_Type await_resume() const
+	{
+		std::lock_guard lock(_state->mutex);
+
+		if (_state->error)
+		{
+			std::rethrow_exception(_state->error);
+		}
+
+		return *_state->value;
+	}
+
+private:
+	struct State
+	{
+		std::mutex mutex;
+		bool ready = false;
+		std::optional<_Type> value;
+		std::exception_ptr error;
+		std::vector<coro::coroutine_handle<>> waiting;
+	};
+
+	template <class _Settle>
+	void settle(_Settle&& settleState)
+	{
+		std::vector<coro::coroutine_handle<>> waiting;
+
+		{
+			std::lock_guard lock(_state->mutex);
+
+			if (_state->ready)
+			{
+				return;
+			}
+
+			settleState(*_state);
+			_state->ready = true;
+			waiting = std::exchange(_state->waiting, {});
+		}
+
+		for (const auto h : waiting)
+		{
+			resumeLater(h);
+		}
+	}
+
+	std::shared_ptr<State> _state;
+};
+
+// Collects the IDs requested by the node and *ById fields in the root Query selection set, so
+// Query::endSelectionSet can fetch each collection once and fan the results back out.
+class BatchLoader
+{
+public:
+	struct Request
+	{
+		NodeType type;
+		response::IdType id;
+		NodeEntity entity {};
+		Eventual<NodeEntity> result {};
+	};
+
+	// Fails any request which was never fetched, so nothing is left waiting on it.
+	~BatchLoader();
+
+	void beginSelectionSet() noexcept;
+	std::vector<Request> endSelectionSet();
+
+	// Returns std::nullopt outside of the selection set, the caller should fetch it right away.
+	std::optional<Eventual<NodeEntity>> load(NodeType type, const response::IdType& id);
+
+private:
+	std::mutex _mutex;
+	size_t _depth = 0;
+	std::vector<Request> _pending;
+
+	// Aliased fields requesting the same ID share a single Request.
+	std::map<std::pair<NodeType, response::IdType>, Eventual<NodeEntity>> _results;
+};
+
+// Monotonic arena for the objects which die with the request, e.g. the connections and their
+// edges. Nothing is freed until the whole arena is released.
+class RequestArena : public std::pmr::memory_resource
+{
+private:
+	void* do_allocate(size_t bytes, size_t alignment) override;
+	void do_deallocate(void*, size_t, size_t) noexcept override;
+	bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override;
+
+	std::mutex _mutex;
+	std::pmr::monotonic_buffer_resource _resource { 4096 };
+};
+
+// Every copy of the allocator, including the one in a shared_ptr control block, keeps the
+// RequestArena alive, so nothing allocated from it can outlive it.
+template <class _Type>
+class ArenaAllocator
+{
+public:
+	using value_type = _Type;
+
+	explicit ArenaAllocator(std::shared_ptr<RequestArena> arena) noexcept
+		: _arena(std::move(arena))
+	{
+	}
+
+	template <class _Other>
+	ArenaAllocator(const ArenaAllocator<_Other>& other) noexcept
+		: _arena(other.arena())
+	{
+	}
+
+	_Type* allocate(size_t count)
+	{
+		return static_cast<_Type*>(_arena->allocate(count * sizeof(_Type), alignof(_Type)));
+	}
+
+	void deallocate(_Type*, size_t) noexcept
+	{
+	}
+
+	const std::shared_ptr<RequestArena>& arena() const noexcept
+	{
+		return _arena;
+	}
+
+	template <class _Other>
+	bool operator==(const ArenaAllocator<_Other>& other) const noexcept
+	{
+		return _arena == other.arena();
+	}
+
+private:
+	std::shared_ptr<RequestArena> _arena;
+};
+
+// Allocates from the arena if there is one, otherwise from the heap.
+template <class _Type, class... _Args>
+std::shared_ptr<_Type> allocateShared(const std::shared_ptr<RequestArena>& arena, _Args&&... args)
+{
+	if (arena)
+	{
+		return std::allocate_shared<_Type>(ArenaAllocator<_Type>(arena),
+			std::forward<_Args>(args)...);
+	}
+
+	return std::make_shared<_Type>(std::forward<_Args>(args)...);
+}
+
+inline std::pmr::memory_resource* memoryResource(const std::shared_ptr<RequestArena>& arena)
+{
+	return arena ? static_cast<std::pmr::memory_resource*>(arena.get())
+				 : std::pmr::new_delete_resource();
+}
+
 struct RequestState : service::RequestState
 {
 	RequestState(size_t id)
@@ -42,22 +435,56 @@ struct RequestState : service::RequestState
 	size_t loadAppointmentsCount = 0;
 	size_t loadTasksCount = 0;
 	size_t loadUnreadCountsCount = 0;
-};
 
-class Appointment;
-class Task;
-class Folder;
-class Expensive;
+	// Batches of IDs looked up by Query::fetchEntities.
+	std::atomic<size_t> fetchEntitiesCount = 0;
+
+	BatchLoader batchLoader;
+	FieldMask fieldMask;
+
+	// Task state as of the start of the request, so it never sees a torn mix of mutations. A
+	// mutation moves it forward to the version it published, so it reads its own writes.
+	std::atomic<std::shared_ptr<const TaskVersion>> taskVersion;
+
+	// Set for a single query or mutation, long lived subscriptions allocate from the heap.
+	std::shared_ptr<RequestArena> arena;
+};
 
 class Query : public std::enable_shared_from_this<Query>
 {
 public:
-	using appointmentsLoader = std::function<std::vector<std::shared_ptr<Appointment>>()>;
-	using tasksLoader = std::function<std::vector<std::shared_ptr<Task>>()>;
-	using unreadCountsLoader = std::function<std::vector<std::shared_ptr<Folder>>()>;
+	// The loaders may leave out any field which is not selected in the FieldMask, e.g. the subject
+	// strings, and Query reloads a collection if a later request selects more fields. A loader
+	// which fetches more than it was asked for adds those fields to the mask, so they never cause
+	// a reload, which would replace the Snapshot and make every cursor into it stale. A loader
+	// which has an IdOrder for the entries sets it, and it must live as long as they do.
+	using appointmentsLoader =
+		std::function<std::vector<std::shared_ptr<Appointment>>(FieldMask&, IdOrder&)>;
+	using tasksLoader = std::function<std::vector<std::shared_ptr<Task>>(FieldMask&, IdOrder&)>;
+	using unreadCountsLoader =
+		std::function<std::vector<std::shared_ptr<Folder>>(FieldMask&, IdOrder&)>;
+
+	using appointmentsPageLoader =
+		std::function<Page<Appointment>(const PageWindow&, const FieldMask&)>;
+	using tasksPageLoader = std::function<Page<Task>(const PageWindow&, const FieldMask&)>;
+	using unreadCountsPageLoader =
+		std::function<Page<Folder>(const PageWindow&, const FieldMask&)>;
+
+	// Optional loaders which only fetch the requested page of a connection, without them the
+	// connections page through the whole collection from the loaders above. The backing store
+	// should answer hasNextPage and hasPreviousPage by probing one entry past either end, and it
+	// can skip the entries entirely if FieldMask::edges is not selected. This is an extension point
+	// for stores which can't hold a whole collection, the binding only sets them to the
+	// EntityStore page loaders if startService is called with pageLoaders.
+	struct PageLoaders
+	{
+		appointmentsPageLoader appointments;
+		tasksPageLoader tasks;
+		unreadCountsPageLoader unreadCounts;
+	};
 
 	explicit Query(appointmentsLoader&& getAppointments, tasksLoader&& getTasks,
-		unreadCountsLoader&& getUnreadCounts);
+		unreadCountsLoader&& getUnreadCounts, PageLoaders&& pageLoaders = {});
 
 	service::AwaitableObject<std::shared_ptr<object::Node>> getNode(
 		service::FieldParams params, response::IdType id);
@@ -73,37 +500,57 @@ public:
 		const service::FieldParams& params, std::optional<int> first,
 		std::optional<response::Value>&& after, std::optional<int> last,
 		std::optional<response::Value>&& before);
-	std::vector<std::shared_ptr<object::Appointment>> getAppointmentsById(
-		const service::FieldParams& params, const std::vector<response::IdType>& ids);
-	std::vector<std::shared_ptr<object::Task>> getTasksById(
-		const service::FieldParams& params, const std::vector<response::IdType>& ids);
-	std::vector<std::shared_ptr<object::Folder>> getUnreadCountsById(
-		const service::FieldParams& params, const std::vector<response::IdType>& ids);
+	service::AwaitableObject<std::vector<std::shared_ptr<object::Appointment>>> getAppointmentsById(
+		service::FieldParams params, std::vector<response::IdType> ids);
+	service::AwaitableObject<std::vector<std::shared_ptr<object::Task>>> getTasksById(
+		service::FieldParams params, std::vector<response::IdType> ids);
+	service::AwaitableObject<std::vector<std::shared_ptr<object::Folder>>> getUnreadCountsById(
+		service::FieldParams params, std::vector<response::IdType> ids);
 	std::shared_ptr<object::NestedType> getNested(service::FieldParams&& params);
 	std::vector<std::shared_ptr<object::Expensive>> getExpensive();
 	TaskState getTestTaskState();
 	std::vector<std::shared_ptr<object::UnionType>> getAnyType(
 		const service::FieldParams& params, const std::vector<response::IdType>& ids);
 
-private:
-	std::shared_ptr<Appointment> findAppointment(
-		const service::FieldParams& params, const response::IdType& id);
-	std::shared_ptr<Task> findTask(const service::FieldParams& params, const response::IdType& id);
-	std::shared_ptr<Folder> findUnreadCount(
-		const service::FieldParams& params, const response::IdType& id);
+	void beginSelectionSet(const service::SelectionSetParams& params);
+	void endSelectionSet(const service::SelectionSetParams& params);
 
-	// Lazy load the fields in each query
-	void loadAppointments(const std::shared_ptr<service::RequestState>& state);
-	void loadTasks(const std::shared_ptr<service::RequestState>& state);
-	void loadUnreadCounts(const std::shared_ptr<service::RequestState>& state);
+	// Shares the wrapper from the current Snapshot if the entity is in it, e.g. for the payload of a
+	// mutation or subscription, without loading anything.
+	std::shared_ptr<object::Appointment> wrap(const std::shared_ptr<Appointment>& entity) const;
+	std::shared_ptr<object::Task> wrap(const std::shared_ptr<Task>& entity) const;
+	std::shared_ptr<object::Folder> wrap(const std::shared_ptr<Folder>& entity) const;
+
+private:
+	// Batched lookups through the BatchLoader in today::RequestState
+	Eventual<NodeEntity> loadEntity(
+		const service::FieldParams& params, NodeType type, const response::IdType& id);
+	void fetchEntities(const std::shared_ptr<service::RequestState>& state,
+		std::vector<BatchLoader::Request>& requests);
+
+	template <class _Object>
+	static void findInSnapshot(NodeType type, const Snapshot<_Object>& snapshot,
+		std::vector<BatchLoader::Request>& requests) noexcept;
+
+	// Lazy load the fields in each query, and return the current snapshot
+	std::shared_ptr<const Snapshot<Appointment>> loadAppointments(
+		const std::shared_ptr<service::RequestState>& state);
+	std::shared_ptr<const Snapshot<Task>> loadTasks(
+		const std::shared_ptr<service::RequestState>& state);
+	std::shared_ptr<const Snapshot<Folder>> loadUnreadCounts(
+		const std::shared_ptr<service::RequestState>& state);
 
 	appointmentsLoader _getAppointments;
 	tasksLoader _getTasks;
 	unreadCountsLoader _getUnreadCounts;
 
-	std::vector<std::shared_ptr<Appointment>> _appointments;
-	std::vector<std::shared_ptr<Task>> _tasks;
-	std::vector<std::shared_ptr<Folder>> _unreadCounts;
+	PageLoaders _pageLoaders;
+
+	// Readers load the current snapshots without locking, reloads are published atomically.
+	std::mutex _loadMutex;
+	std::atomic<std::shared_ptr<const Snapshot<Appointment>>> _appointments;
+	std::atomic<std::shared_ptr<const Snapshot<Task>>> _tasks;
+	std::atomic<std::shared_ptr<const Snapshot<Folder>>> _unreadCounts;
 };
 
 class PageInfo
@@ -130,36 +577,484 @@ private:
 	const bool _hasPreviousPage;
 };
 
+// Column values, which are either owned while building an EntityStore in code, or which point
+// into the MappedFile of a dataset.
+template <class _Type>
+class Column
+{
+public:
+	void push_back(const _Type& value)
+	{
+		_owned.push_back(value);
+		_values = _owned;
+	}
+
+	template <class _Range>
+	void append(const _Range& values)
+	{
+		_owned.insert(_owned.end(), values.begin(), values.end());
+		_values = _owned;
+	}
+
+	void map(std::span<const _Type> values) noexcept
+	{
+		_owned.clear();
+		_values = values;
+	}
+
+	size_t size() const noexcept
+	{
+		return _values.size();
+	}
+
+	const _Type& operator[](size_t row) const noexcept
+	{
+		return _values[row];
+	}
+
+	std::span<const _Type> values() const noexcept
+	{
+		return _values;
+	}
+
+private:
+	std::vector<_Type> _owned;
+	std::span<const _Type> _values;
+};
+
+// Chunk i of the append-only containers below holds firstChunkSize << i entries, starting at
+// firstChunkSize * ((1 << i) - 1). The chunks double in size and never move once they're allocated.
+struct ChunkLayout
+{
+	static constexpr size_t firstChunkSize = 64;
+	static constexpr size_t chunkCount = 48;
+
+	struct Position
+	{
+		size_t chunk;
+		size_t offset;
+	};
+
+	static Position locate(size_t index) noexcept
+	{
+		const size_t scaled = index / firstChunkSize + 1;
+		const size_t chunk = static_cast<size_t>(std::bit_width(scaled)) - 1;
+
+		return { chunk, index - firstChunkSize * ((size_t { 1 } << chunk) - 1) };
+	}
+
+	static constexpr size_t chunkSize(size_t chunk) noexcept
+	{
+		return firstChunkSize << chunk;
+	}
+};
+
+// Append-only array with one writer at a time, readers don't take a lock. Each element is written
+// before the size which covers it is published, and it never moves after that.
+template <class _Type>
+class AppendOnlyArray
+{
+public:
+	AppendOnlyArray() = default;
+	AppendOnlyArray(const AppendOnlyArray&) = delete;
+	AppendOnlyArray& operator=(const AppendOnlyArray&) = delete;
+
+	~AppendOnlyArray()
+	{
+		for (auto chunk : _chunks)
+		{
+			delete[] chunk;
+		}
+	}
+
+	size_t size() const noexcept
+	{
+		return _size.load(std::memory_order_acquire);
+	}
+
+	// Only valid for an index less than a size this thread has loaded.
+	const _Type& operator[](size_t index) const noexcept
+	{
+		const auto position = ChunkLayout::locate(index);
+
+		return _chunks[position.chunk][position.offset];
+	}
+
+	void push_back(_Type value)
+	{
+		const auto index = _size.load(std::memory_order_relaxed);
+		const auto position = ChunkLayout::locate(index);
+		auto& chunk = _chunks[position.chunk];
+
+		if (!chunk)
+		{
+			chunk = new _Type[ChunkLayout::chunkSize(position.chunk)];
+		}
+
+		chunk[position.offset] = std::move(value);
+		_size.store(index + 1, std::memory_order_release);
+	}
+
+private:
+	// A chunk pointer is set before the first size which reaches into it is published.
+	std::array<_Type*, ChunkLayout::chunkCount> _chunks {};
+	std::atomic<size_t> _size = 0;
+};
+
+// Append-only slots for values which are created the first time they're read. The chunks never
+// move once they're allocated, so readers and writers only use atomic loads and compare-and-swap
+// on the slots, and there's no lock on the read path.
+template <class _Value>
+class LazySlots
+{
+public:
+	using value_ptr = std::shared_ptr<const _Value>;
+
+	LazySlots() = default;
+	LazySlots(const LazySlots&) = delete;
+	LazySlots& operator=(const LazySlots&) = delete;
+
+	~LazySlots()
+	{
+		for (auto& chunk : _chunks)
+		{
+			delete[] chunk.load(std::memory_order_acquire);
+		}
+	}
+
+	// Returns the value in the slot, or stores the one from create if it's still empty. If another
+	// thread stores a value first, everyone shares that one.
+	template <class _Create>
+	value_ptr get(size_t index, _Create&& create) const
+	{
+		auto& slot = this->slot(index);
+		auto value = slot.load(std::memory_order_acquire);
+
+		if (!value)
+		{
+			auto created = std::make_shared<const _Value>(create());
+
+			value = slot.compare_exchange_strong(value, created, std::memory_order_acq_rel)
+				? std::move(created)
+				: value;
+		}
+
+		return value;
+	}
+
+private:
+	using slot_type = std::atomic<value_ptr>;
+
+	slot_type& slot(size_t index) const
+	{
+		const auto [chunk, offset] = ChunkLayout::locate(index);
+		auto& entry = _chunks[chunk];
+		auto slots = entry.load(std::memory_order_acquire);
+
+		if (!slots)
+		{
+			auto allocated = new slot_type[ChunkLayout::chunkSize(chunk)];
+
+			if (entry.compare_exchange_strong(slots, allocated, std::memory_order_acq_rel))
+			{
+				slots = allocated;
+			}
+			else
+			{
+				delete[] allocated;
+			}
+		}
+
+		return slots[offset];
+	}
+
+	mutable std::array<std::atomic<slot_type*>, ChunkLayout::chunkCount> _chunks {};
+};
+
+// Interned strings shared by every column in an EntityStore, index 0 is always null. Repeated
+// values are stored once, and the response::Value for each string is only created the first time
+// it's resolved, then every response shares that handle. Only interning takes the mutex. Interned
+// strings never move, so resolving never waits on it, even if more strings are interned meanwhile.
+class StringPool
+{
+public:
+	explicit StringPool();
+
+	std::uint32_t intern(std::optional<std::string>&& value);
+
+	// Map the string table of a dataset, before anything reads from the pool.
+	void map(std::span<const std::uint64_t> offsets, std::span<const char> bytes);
+
+	size_t size() const noexcept
+	{
+		return _mapped ? _mappedOffsets.size() - 1 : _views.size();
+	}
+
+	// Mapped offsets are only checked as each string is read, so mapping a dataset doesn't scan
+	// them.
+	bool valid(std::uint32_t index) const noexcept
+	{
+		if (!_mapped)
+		{
+			return index < _views.size();
+		}
+
+		return index < size() && _mappedOffsets[index] <= _mappedOffsets[index + 1]
+			&& _mappedOffsets[index + 1] <= _mappedBytes.size();
+	}
+
+	// Zero-copy view of the string bytes
+	std::string_view view(std::uint32_t index) const noexcept
+	{
+		if (!_mapped)
+		{
+			return _views[index];
+		}
+
+		return { _mappedBytes.data() + _mappedOffsets[index],
+			static_cast<size_t>(_mappedOffsets[index + 1] - _mappedOffsets[index]) };
+	}
+
+	// Throws if the index is not valid in a mapped dataset.
+	std::shared_ptr<const response::Value> operator[](std::uint32_t index) const;
+
+	// Contiguous string table for a dataset, a mapped one is copied as is.
+	std::vector<std::uint64_t> offsets() const;
+	std::vector<char> bytes() const;
+
+private:
+	// The index hashes and compares the pooled bytes in place, rather than keeping a second copy
+	// of every string as its key.
+	struct IndexHash
+	{
+		using is_transparent = void;
+
+		size_t operator()(std::string_view value) const noexcept
+		{
+			return std::hash<std::string_view> {}(value);
+		}
+
+		size_t operator()(std::uint32_t index) const noexcept
+		{
+			return (*this)(pool->view(index));
+		}
+
+		const StringPool* pool;
+	};
+
+	struct IndexEqual
+	{
+		using is_transparent = void;
+
+		template <class _Lhs, class _Rhs>
+		bool operator()(const _Lhs& lhs, const _Rhs& rhs) const noexcept
+		{
+			return key(lhs) == key(rhs);
+		}
+
+		std::string_view key(std::string_view value) const noexcept
+		{
+			return value;
+		}
+
+		std::string_view key(std::uint32_t index) const noexcept
+		{
+			return pool->view(index);
+		}
+
+		const StringPool* pool;
+	};
+
+	bool _mapped = false;
+	std::span<const std::uint64_t> _mappedOffsets;
+	std::span<const char> _mappedBytes;
+
+	// Interned strings, the std::deque never moves them as it grows, and _views points at them.
+	std::deque<std::string> _owned;
+	AppendOnlyArray<std::string_view> _views;
+	std::unordered_set<std::uint32_t, IndexHash, IndexEqual> _index;
+
+	mutable std::mutex _internMutex;
+	LazySlots<response::Value> _values;
+};
+
+// Contiguous ID bytes for every row, row i spans from _offsets[i] to _offsets[i + 1].
+class IdColumn
+{
+public:
+	explicit IdColumn();
+
+	void push_back(const response::IdType& id);
+	void map(std::span<const std::uint64_t> offsets, std::span<const std::uint8_t> bytes,
+		IdOrder order);
+
+	size_t size() const noexcept
+	{
+		return _offsets.size() - 1;
+	}
+
+	// Mapped offsets are only checked as each row is read, a corrupt row has an empty ID.
+	bool valid(size_t row) const noexcept
+	{
+		return _offsets[row] <= _offsets[row + 1] && _offsets[row + 1] <= _bytes.size();
+	}
+
+	std::span<const std::uint8_t> operator[](size_t row) const noexcept
+	{
+		if (!valid(row))
+		{
+			return {};
+		}
+
+		return _bytes.values().subspan(_offsets[row], _offsets[row + 1] - _offsets[row]);
+	}
+
+	// Each row's ID is converted to a response::Value once and shared by every getId after that.
+	// Throws if the row is corrupt.
+	std::shared_ptr<const response::Value> value(size_t row) const;
+
+	// Rows sorted by GlobalId::key, from the dataset or sorted on first use after the rows have
+	// been added.
+	IdOrder order() const;
+
+	// No more rows may be added once they're ordered.
+	bool ordered() const noexcept
+	{
+		return _ordered.load(std::memory_order_acquire);
+	}
+
+	// Raw and global IDs find the same row.
+	std::optional<size_t> find(std::span<const std::uint8_t> id) const;
+
+	std::span<const std::uint64_t> offsets() const noexcept
+	{
+		return _offsets.values();
+	}
+
+	std::span<const std::uint8_t> bytes() const noexcept
+	{
+		return _bytes.values();
+	}
+
+private:
+	Column<std::uint64_t> _offsets;
+	Column<std::uint8_t> _bytes;
+
+	mutable std::once_flag _orderOnce;
+	mutable Column<std::uint32_t> _order;
+	mutable std::atomic<bool> _ordered = false;
+
+	LazySlots<response::Value> _values;
+};
+
+struct AppointmentColumns
+{
+	IdColumn id;
+	Column<std::uint32_t> when;
+	Column<std::uint32_t> subject;
+	Column<std::uint8_t> isNow;
+};
+
+struct TaskColumns;
+
+// Immutable version of the task state which mutations change. An update copies the chunk table
+// and the one chunk it changes, then publishes the new TaskVersion with a compare-and-swap.
+struct TaskVersion
+{
+	static constexpr size_t chunkSize = 1024;
+
+	struct Chunk
+	{
+		std::array<std::uint8_t, chunkSize> isComplete {};
+		std::array<TaskState, chunkSize> state {};
+	};
+
+	const TaskColumns* columns = nullptr;
+	size_t version = 0;
+
+	// Chunks which have not been updated are null, they read through to the TaskColumns.
+	std::vector<std::shared_ptr<const Chunk>> chunks;
+};
+
+struct TaskColumns
+{
+	IdColumn id;
+	Column<std::uint32_t> title;
+	Column<std::uint8_t> isComplete;
+	Column<TaskState> state;
+
+	std::atomic<std::shared_ptr<const TaskVersion>> version;
+
+	// The TaskVersion pinned in today::RequestState, or the current one without a request.
+	std::shared_ptr<const TaskVersion> pinned(
+		const std::shared_ptr<service::RequestState>& state) const;
+
+	bool getIsComplete(const TaskVersion& taskVersion, size_t row) const noexcept;
+	TaskState getState(const TaskVersion& taskVersion, size_t row) const noexcept;
+};
+
+struct FolderColumns
+{
+	IdColumn id;
+	Column<std::uint32_t> name;
+	Column<std::int32_t> unreadCount;
+};
+
+// Read-only mapping of a whole file, the OS shares the physical pages between processes.
+class MappedFile
+{
+public:
+	explicit MappedFile(const std::string& path);
+	~MappedFile();
+
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+
+	std::span<const std::uint8_t> bytes() const noexcept
+	{
+		return { _data, _size };
+	}
+
+private:
+	const std::uint8_t* _data = nullptr;
+	size_t _size = 0;
+};
+
 class Appointment
 {
 public:
-	explicit Appointment(
-		response::IdType&& id, std::string&& when, std::string&& subject, bool isNow);
+	// Row view created by EntityStore::addAppointment
+	explicit Appointment(const AppointmentColumns& columns, const StringPool& strings, size_t row)
+		: _columns(columns)
+		, _strings(strings)
+		, _row(row)
+	{
+	}
 
 	// EdgeConstraints accessor
-	const response::IdType& id() const noexcept
+	std::span<const std::uint8_t> id() const noexcept
 	{
-		return _id;
+		return _columns.id[_row];
 	}
 
-	service::AwaitableScalar<response::IdType> getId() const noexcept
+	service::AwaitableScalar<response::IdType> getId() const
 	{
-		return _id;
+		return _columns.id.value(_row);
 	}
 
-	std::shared_ptr<const response::Value> getWhen() const noexcept
+	std::shared_ptr<const response::Value> getWhen() const
 	{
-		return _when;
+		return _strings[_columns.when[_row]];
 	}
 
-	std::shared_ptr<const response::Value> getSubject() const noexcept
+	std::shared_ptr<const response::Value> getSubject() const
 	{
-		return _subject;
+		return _strings[_columns.subject[_row]];
 	}
 
 	bool getIsNow() const noexcept
 	{
-		return _isNow;
+		return _columns.isNow[_row] != 0;
 	}
 
 	std::optional<std::string> getForceError() const
@@ -168,262 +1063,543 @@ public:
 	}
 
 private:
-	response::IdType _id;
-	std::shared_ptr<const response::Value> _when;
-	std::shared_ptr<const response::Value> _subject;
-	bool _isNow;
+	const AppointmentColumns& _columns;
+	const StringPool& _strings;
+	const size_t _row;
 };
 
 class AppointmentEdge
 {
 public:
-	explicit AppointmentEdge(std::shared_ptr<Appointment> appointment)
+	explicit AppointmentEdge(std::shared_ptr<Appointment> appointment,
+		std::shared_ptr<const Snapshot<Appointment>> snapshot, size_t version, size_t position)
 		: _appointment(std::move(appointment))
+		, _snapshot(std::move(snapshot))
+		, _version(version)
+		, _position(position)
 	{
 	}
 
 	std::shared_ptr<object::Appointment> getNode() const noexcept
 	{
-		return std::make_shared<object::Appointment>(_appointment);
+		return _snapshot ? _snapshot->wrap(_position)
+						 : std::make_shared<object::Appointment>(_appointment);
 	}
 
 	service::AwaitableScalar<response::Value> getCursor() const
 	{
-		co_return response::Value(co_await _appointment->getId());
+		// Already resolved, so skip the coroutine frame and encode straight from the row.
+		return response::Value(
+			ItemCursor::encode(NodeType::Appointment, _version, _position, _appointment->id()));
 	}
 
 private:
 	std::shared_ptr<Appointment> _appointment;
+	std::shared_ptr<const Snapshot<Appointment>> _snapshot;
+	size_t _version;
+	size_t _position;
 };
 
 class AppointmentConnection
 {
 public:
-	explicit AppointmentConnection(bool hasNextPage, bool hasPreviousPage,
-		std::vector<std::shared_ptr<Appointment>> appointments)
-		: _pageInfo(std::make_shared<PageInfo>(hasNextPage, hasPreviousPage))
-		, _appointments(std::move(appointments))
+	explicit AppointmentConnection(
+		Page<Appointment>&& page, std::shared_ptr<RequestArena> arena = {})
+		: _pageInfo(allocateShared<object::PageInfo>(arena,
+			allocateShared<PageInfo>(arena, page.hasNextPage, page.hasPreviousPage)))
+		, _entries(std::move(page.entries))
+		, _appointments(page.page)
+		, _snapshot(std::move(page.snapshot))
+		, _version(page.version)
+		, _offset(page.offset)
+		, _arena(std::move(arena))
 	{
 	}
 
 	std::shared_ptr<object::PageInfo> getPageInfo() const noexcept
 	{
-		return std::make_shared<object::PageInfo>(_pageInfo);
+		return _pageInfo;
 	}
 
+	// Aliases and fragments which select the edges more than once share the same wrappers.
 	std::optional<std::vector<std::shared_ptr<object::AppointmentEdge>>> getEdges() const noexcept
 	{
-		auto result = std::make_optional<std::vector<std::shared_ptr<object::AppointmentEdge>>>(
-			_appointments.size());
+		std::call_once(_edgesOnce, [this]() noexcept {
+			// Every edge on the page shares one allocation, each wrapper aliases its own entry.
+			auto implementations =
+				allocateShared<std::pmr::vector<AppointmentEdge>>(_arena, memoryResource(_arena));
+			auto& edges = _edges.emplace(_appointments.size());
+
+			implementations->reserve(_appointments.size());
 
-		std::transform(_appointments.cbegin(),
-			_appointments.cend(),
-			result->begin(),
-			[](const std::shared_ptr<Appointment>& node) {
-				return std::make_shared<object::AppointmentEdge>(
-					std::make_shared<AppointmentEdge>(node));
-			});
+			for (size_t i = 0; i < _appointments.size(); ++i)
+			{
+				auto& implementation = implementations->emplace_back(_appointments[i],
+					_snapshot,
+					_version,
+					_offset + i);
+
+				edges[i] = allocateShared<object::AppointmentEdge>(_arena,
+					std::shared_ptr<AppointmentEdge>(implementations, &implementation));
+			}
+		});
 
-		return result;
+		return _edges;
 	}
 
 private:
-	std::shared_ptr<PageInfo> _pageInfo;
-	std::vector<std::shared_ptr<Appointment>> _appointments;
+	std::shared_ptr<object::PageInfo> _pageInfo;
+	std::shared_ptr<const Snapshot<Appointment>::vec_type> _entries;
+	Snapshot<Appointment>::view_type _appointments;
+	std::shared_ptr<const Snapshot<Appointment>> _snapshot;
+	size_t _version;
+	size_t _offset;
+	const std::shared_ptr<RequestArena> _arena;
+
+	mutable std::once_flag _edgesOnce;
+	mutable std::optional<std::vector<std::shared_ptr<object::AppointmentEdge>>> _edges;
 };
 
 class Task
 {
 public:
-	explicit Task(response::IdType&& id, std::string&& title, bool isComplete);
+	// Row view created by EntityStore::addTask
+	explicit Task(const TaskColumns& columns, const StringPool& strings, size_t row)
+		: _columns(columns)
+		, _strings(strings)
+		, _row(row)
+	{
+	}
 
 	// EdgeConstraints accessor
-	const response::IdType& id() const
+	std::span<const std::uint8_t> id() const noexcept
 	{
-		return _id;
+		return _columns.id[_row];
 	}
 
-	service::AwaitableScalar<response::IdType> getId() const noexcept
+	service::AwaitableScalar<response::IdType> getId() const
 	{
-		return _id;
+		return _columns.id.value(_row);
 	}
 
-	std::shared_ptr<const response::Value> getTitle() const noexcept
+	std::shared_ptr<const response::Value> getTitle() const
 	{
-		return _title;
+		return _strings[_columns.title[_row]];
 	}
 
-	bool getIsComplete() const noexcept
+	bool getIsComplete(service::FieldParams&& params) const
 	{
-		return _isComplete;
+		return _columns.getIsComplete(*_columns.pinned(params.state), _row);
 	}
 
 private:
-	response::IdType _id;
-	std::shared_ptr<const response::Value> _title;
-	bool _isComplete;
-	TaskState _state = TaskState::New;
+	const TaskColumns& _columns;
+	const StringPool& _strings;
+	const size_t _row;
 };
 
 class TaskEdge
 {
 public:
-	explicit TaskEdge(std::shared_ptr<Task> task)
+	explicit TaskEdge(std::shared_ptr<Task> task,
+		std::shared_ptr<const Snapshot<Task>> snapshot, size_t version, size_t position)
 		: _task(std::move(task))
+		, _snapshot(std::move(snapshot))
+		, _version(version)
+		, _position(position)
 	{
 	}
 
 	std::shared_ptr<object::Task> getNode() const noexcept
 	{
-		return std::make_shared<object::Task>(_task);
+		return _snapshot ? _snapshot->wrap(_position) : std::make_shared<object::Task>(_task);
 	}
 
-	service::AwaitableScalar<response::Value> getCursor() const noexcept
+	service::AwaitableScalar<response::Value> getCursor() const
 	{
-		co_return response::Value(co_await _task->getId());
+		// Already resolved, so skip the coroutine frame and encode straight from the row.
+		return response::Value(
+			ItemCursor::encode(NodeType::Task, _version, _position, _task->id()));
 	}
 
 private:
 	std::shared_ptr<Task> _task;
+	std::shared_ptr<const Snapshot<Task>> _snapshot;
+	size_t _version;
+	size_t _position;
 };
 
 class TaskConnection
 {
 public:
-	explicit TaskConnection(
-		bool hasNextPage, bool hasPreviousPage, std::vector<std::shared_ptr<Task>> tasks)
-		: _pageInfo(std::make_shared<PageInfo>(hasNextPage, hasPreviousPage))
-		, _tasks(std::move(tasks))
+	explicit TaskConnection(Page<Task>&& page, std::shared_ptr<RequestArena> arena = {})
+		: _pageInfo(allocateShared<object::PageInfo>(arena,
+			allocateShared<PageInfo>(arena, page.hasNextPage, page.hasPreviousPage)))
+		, _entries(std::move(page.entries))
+		, _tasks(page.page)
+		, _snapshot(std::move(page.snapshot))
+		, _version(page.version)
+		, _offset(page.offset)
+		, _arena(std::move(arena))
 	{
 	}
 
 	std::shared_ptr<object::PageInfo> getPageInfo() const noexcept
 	{
-		return std::make_shared<object::PageInfo>(_pageInfo);
+		return _pageInfo;
 	}
 
+	// Aliases and fragments which select the edges more than once share the same wrappers.
 	std::optional<std::vector<std::shared_ptr<object::TaskEdge>>> getEdges() const noexcept
 	{
-		auto result =
-			std::make_optional<std::vector<std::shared_ptr<object::TaskEdge>>>(_tasks.size());
+		std::call_once(_edgesOnce, [this]() noexcept {
+			// Every edge on the page shares one allocation, each wrapper aliases its own entry.
+			auto implementations =
+				allocateShared<std::pmr::vector<TaskEdge>>(_arena, memoryResource(_arena));
+			auto& edges = _edges.emplace(_tasks.size());
+
+			implementations->reserve(_tasks.size());
+
+			for (size_t i = 0; i < _tasks.size(); ++i)
+			{
+				auto& implementation =
+					implementations->emplace_back(_tasks[i], _snapshot, _version, _offset + i);
 
-		std::transform(_tasks.cbegin(),
-			_tasks.cend(),
-			result->begin(),
-			[](const std::shared_ptr<Task>& node) {
-				return std::make_shared<object::TaskEdge>(std::make_shared<TaskEdge>(node));
-			});
+				edges[i] = allocateShared<object::TaskEdge>(_arena,
+					std::shared_ptr<TaskEdge>(implementations, &implementation));
+			}
+		});
 
-		return result;
+		return _edges;
 	}
 
 private:
-	std::shared_ptr<PageInfo> _pageInfo;
-	std::vector<std::shared_ptr<Task>> _tasks;
+	std::shared_ptr<object::PageInfo> _pageInfo;
+	std::shared_ptr<const Snapshot<Task>::vec_type> _entries;
+	Snapshot<Task>::view_type _tasks;
+	std::shared_ptr<const Snapshot<Task>> _snapshot;
+	size_t _version;
+	size_t _offset;
+	const std::shared_ptr<RequestArena> _arena;
+
+	mutable std::once_flag _edgesOnce;
+	mutable std::optional<std::vector<std::shared_ptr<object::TaskEdge>>> _edges;
 };
 
 class Folder
 {
 public:
-	explicit Folder(response::IdType&& id, std::string&& name, int unreadCount);
+	// Row view created by EntityStore::addFolder
+	explicit Folder(const FolderColumns& columns, const StringPool& strings, size_t row)
+		: _columns(columns)
+		, _strings(strings)
+		, _row(row)
+	{
+	}
 
 	// EdgeConstraints accessor
-	const response::IdType& id() const noexcept
+	std::span<const std::uint8_t> id() const noexcept
 	{
-		return _id;
+		return _columns.id[_row];
 	}
 
-	service::AwaitableScalar<response::IdType> getId() const noexcept
+	service::AwaitableScalar<response::IdType> getId() const
 	{
-		return _id;
+		return _columns.id.value(_row);
 	}
 
-	std::shared_ptr<const response::Value> getName() const noexcept
+	std::shared_ptr<const response::Value> getName() const
 	{
-		return _name;
+		return _strings[_columns.name[_row]];
 	}
 
 	int getUnreadCount() const noexcept
 	{
-		return _unreadCount;
+		return _columns.unreadCount[_row];
 	}
 
 private:
-	response::IdType _id;
-	std::shared_ptr<const response::Value> _name;
-	int _unreadCount;
+	const FolderColumns& _columns;
+	const StringPool& _strings;
+	const size_t _row;
+};
+
+// Typed event for a write to an EntityStore, numbered in the order it was captured.
+struct ChangeEvent
+{
+	size_t sequence = 0;
+	NodeType type = NodeType::Unknown;
+	NodeEntity entity;
+
+	// TaskVersion published by a task update, so subscribers resolve the state as of this event.
+	std::shared_ptr<const TaskVersion> taskVersion {};
+};
+
+// In-process change data capture log. Writers append a ChangeEvent for every entity they change,
+// and a single consumer takes them in sequence order.
+class ChangeLog
+{
+public:
+	void append(NodeType type, NodeEntity&& entity,
+		std::shared_ptr<const TaskVersion> taskVersion = {});
+
+	// Waits for more events, returns an empty batch once the log is closed and drained.
+	std::vector<ChangeEvent> consume();
+	void close();
+
+private:
+	std::mutex _mutex;
+	std::condition_variable _condition;
+	std::vector<ChangeEvent> _events;
+	size_t _nextSequence = 1;
+	bool _closed = false;
+};
+
+// Columnar storage for the entities, which are lightweight row views over it. The row views
+// share ownership of the store and the Snapshot indexes point into the ID columns, so add all of
+// the rows before resolving any requests which read them. Unselected strings may be left out by
+// the loaders, they resolve to null.
+class EntityStore : public std::enable_shared_from_this<EntityStore>
+{
+public:
+	explicit EntityStore();
+
+	// Map a dataset written by save, the columns and strings are read in place from the file.
+	static std::shared_ptr<EntityStore> load(const std::string& path);
+
+	// Atomically replace the dataset, it's written to a temporary file and synced before the
+	// rename, and the directory is synced after it.
+	void save(const std::string& path) const;
+
+	// Stores loaded from a dataset are read-only.
+	std::shared_ptr<Appointment> addAppointment(response::IdType&& id,
+		std::optional<std::string>&& when, std::optional<std::string>&& subject, bool isNow);
+	std::shared_ptr<Task> addTask(
+		response::IdType&& id, std::optional<std::string>&& title, bool isComplete);
+	std::shared_ptr<Folder> addFolder(
+		response::IdType&& id, std::optional<std::string>&& name, int unreadCount);
+
+	// The row views are created on first use, so mapping a dataset doesn't touch every row.
+	std::vector<std::shared_ptr<Appointment>> appointments();
+	std::vector<std::shared_ptr<Task>> tasks();
+	std::vector<std::shared_ptr<Folder>> folders();
+
+	// Query::PageLoaders which page through the columns in place, and only create the row views
+	// on the page. Their cursors seek by position in the store, or by ID.
+	Page<Appointment> appointmentPage(const PageWindow& window, const FieldMask& fields);
+	Page<Task> taskPage(const PageWindow& window, const FieldMask& fields);
+	Page<Folder> folderPage(const PageWindow& window, const FieldMask& fields);
+
+	// Rows in each collection sorted by ID, for a Snapshot of the row views above.
+	IdOrder appointmentOrder() const;
+	IdOrder taskOrder() const;
+	IdOrder folderOrder() const;
+
+	// Raw and global IDs find the same task. A store built in code sorts its IDs on first use,
+	// after which it's read-only.
+	std::optional<size_t> findTask(std::span<const std::uint8_t> id) const;
+	std::shared_ptr<Task> task(std::span<const std::uint8_t> id);
+
+	// Mutations may update tasks in a read-only store too. Returns the TaskVersion it published,
+	// or nullptr if there is no such task. Requests which started earlier keep reading the
+	// TaskVersion they pinned.
+	std::shared_ptr<const TaskVersion> updateTask(std::span<const std::uint8_t> id,
+		std::optional<bool> isComplete, std::optional<TaskState> state);
+
+	std::shared_ptr<const TaskVersion> taskVersion() const noexcept;
+
+	// Capture a ChangeEvent for every update, set it before resolving any requests.
+	void captureChanges(std::shared_ptr<ChangeLog> changeLog) noexcept;
+
+private:
+	void checkWritable() const;
+	void writeDataset(const std::string& path) const;
+
+	template <class _Row, class _Columns>
+	std::shared_ptr<_Row> row(std::deque<_Row>& rows, const _Columns& columns, size_t position);
+	template <class _Row, class _Columns>
+	std::vector<std::shared_ptr<_Row>> rows(std::deque<_Row>& rows, const _Columns& columns);
+	template <class _Row, class _Columns>
+	Page<_Row> page(std::deque<_Row>& rows, const _Columns& columns, NodeType type,
+		const PageWindow& window, const FieldMask& fields);
+
+	// Version of the ItemCursor values from the page loaders.
+	const size_t _version;
+
+	std::unique_ptr<MappedFile> _file;
+	std::shared_ptr<ChangeLog> _changeLog;
+
+	StringPool _strings;
+
+	AppointmentColumns _appointmentColumns;
+	TaskColumns _taskColumns;
+	FolderColumns _folderColumns;
+
+	// std::deque keeps the row views in place as it grows, they alias the store's ownership.
+	std::mutex _rowsMutex;
+	std::deque<Appointment> _appointments;
+	std::deque<Task> _tasks;
+	std::deque<Folder> _folders;
+};
+
+// Append-only log of the task updates since the dataset was last written, in a file next to the
+// dataset. A writer thread flushes the records in groups, and once enough of them accumulate it
+// rotates the file and folds them into a new dataset in the background.
+class Journal
+{
+public:
+	struct Record
+	{
+		response::IdType taskId;
+		std::optional<bool> isComplete;
+		std::optional<TaskState> state;
+	};
+
+	// Records written before the journal is rotated and compacted into the dataset.
+	static constexpr size_t defaultCompactAfter = 1000;
+
+	// Replay the journal tail into a store loaded from the dataset, then open it for appending.
+	explicit Journal(std::shared_ptr<EntityStore> store, std::string dataset,
+		size_t compactAfter = defaultCompactAfter);
+	~Journal();
+
+	// The writer applies each record to the store only once it's durable, in the same order it
+	// was journaled, and resolves with the TaskVersion that published it. Nothing is applied if
+	// the write fails.
+	Eventual<std::shared_ptr<const TaskVersion>> append(Record&& record);
+
+private:
+	void replay(const std::string& path);
+	void write();
+	void compact(std::string rotatedPath);
+
+	const std::shared_ptr<EntityStore> _store;
+	const std::string _dataset;
+	const std::string _path;
+	const size_t _compactAfter;
+
+	std::mutex _mutex;
+	std::condition_variable _condition;
+	std::vector<std::pair<Record, Eventual<std::shared_ptr<const TaskVersion>>>> _pending;
+	bool _stopping = false;
+
+	// Only used on the writer thread
+	std::FILE* _file = nullptr;
+	size_t _records = 0;
+	std::future<void> _compacting;
+
+	std::thread _writer;
 };
 
 class FolderEdge
 {
 public:
-	explicit FolderEdge(std::shared_ptr<Folder> folder)
+	explicit FolderEdge(std::shared_ptr<Folder> folder,
+		std::shared_ptr<const Snapshot<Folder>> snapshot, size_t version, size_t position)
 		: _folder(std::move(folder))
+		, _snapshot(std::move(snapshot))
+		, _version(version)
+		, _position(position)
 	{
 	}
 
 	std::shared_ptr<object::Folder> getNode() const noexcept
 	{
-		return std::make_shared<object::Folder>(_folder);
+		return _snapshot ? _snapshot->wrap(_position) : std::make_shared<object::Folder>(_folder);
 	}
 
-	service::AwaitableScalar<response::Value> getCursor() const noexcept
+	service::AwaitableScalar<response::Value> getCursor() const
 	{
-		co_return response::Value(co_await _folder->getId());
+		// Already resolved, so skip the coroutine frame and encode straight from the row.
+		return response::Value(
+			ItemCursor::encode(NodeType::Folder, _version, _position, _folder->id()));
 	}
 
 private:
 	std::shared_ptr<Folder> _folder;
+	std::shared_ptr<const Snapshot<Folder>> _snapshot;
+	size_t _version;
+	size_t _position;
 };
 
 class FolderConnection
 {
 public:
-	explicit FolderConnection(
-		bool hasNextPage, bool hasPreviousPage, std::vector<std::shared_ptr<Folder>> folders)
-		: _pageInfo(std::make_shared<PageInfo>(hasNextPage, hasPreviousPage))
-		, _folders(std::move(folders))
+	explicit FolderConnection(Page<Folder>&& page, std::shared_ptr<RequestArena> arena = {})
+		: _pageInfo(allocateShared<object::PageInfo>(arena,
+			allocateShared<PageInfo>(arena, page.hasNextPage, page.hasPreviousPage)))
+		, _entries(std::move(page.entries))
+		, _folders(page.page)
+		, _snapshot(std::move(page.snapshot))
+		, _version(page.version)
+		, _offset(page.offset)
+		, _arena(std::move(arena))
 	{
 	}
 
 	std::shared_ptr<object::PageInfo> getPageInfo() const noexcept
 	{
-		return std::make_shared<object::PageInfo>(_pageInfo);
+		return _pageInfo;
 	}
 
+	// Aliases and fragments which select the edges more than once share the same wrappers.
 	std::optional<std::vector<std::shared_ptr<object::FolderEdge>>> getEdges() const noexcept
 	{
-		auto result =
-			std::make_optional<std::vector<std::shared_ptr<object::FolderEdge>>>(_folders.size());
+		std::call_once(_edgesOnce, [this]() noexcept {
+			// Every edge on the page shares one allocation, each wrapper aliases its own entry.
+			auto implementations =
+				allocateShared<std::pmr::vector<FolderEdge>>(_arena, memoryResource(_arena));
+			auto& edges = _edges.emplace(_folders.size());
+
+			implementations->reserve(_folders.size());
 
-		std::transform(_folders.cbegin(),
-			_folders.cend(),
-			result->begin(),
-			[](const std::shared_ptr<Folder>& node) {
-				return std::make_shared<object::FolderEdge>(std::make_shared<FolderEdge>(node));
-			});
+			for (size_t i = 0; i < _folders.size(); ++i)
+			{
+				auto& implementation =
+					implementations->emplace_back(_folders[i], _snapshot, _version, _offset + i);
 
-		return result;
+				edges[i] = allocateShared<object::FolderEdge>(_arena,
+					std::shared_ptr<FolderEdge>(implementations, &implementation));
+			}
+		});
+
+		return _edges;
 	}
 
 private:
-	std::shared_ptr<PageInfo> _pageInfo;
-	std::vector<std::shared_ptr<Folder>> _folders;
+	std::shared_ptr<object::PageInfo> _pageInfo;
+	std::shared_ptr<const Snapshot<Folder>::vec_type> _entries;
+	Snapshot<Folder>::view_type _folders;
+	std::shared_ptr<const Snapshot<Folder>> _snapshot;
+	size_t _version;
+	size_t _offset;
+	const std::shared_ptr<RequestArena> _arena;
+
+	mutable std::once_flag _edgesOnce;
+	mutable std::optional<std::vector<std::shared_ptr<object::FolderEdge>>> _edges;
 };
 
 class CompleteTaskPayload
 {
 public:
-	explicit CompleteTaskPayload(
-		std::shared_ptr<Task> task, std::optional<std::string>&& clientMutationId)
+	explicit CompleteTaskPayload(std::shared_ptr<object::Task> task,
+		Eventual<std::shared_ptr<const TaskVersion>> written,
+		std::optional<std::string>&& clientMutationId)
 		: _task(std::move(task))
+		, _written(std::move(written))
 		, _clientMutationId(std::move(clientMutationId))
 	{
 	}
 
-	std::shared_ptr<object::Task> getTask() const noexcept
+	// Set once the update is durable and applied to the store.
+	const Eventual<std::shared_ptr<const TaskVersion>>& written() const noexcept
+	{
+		return _written;
+	}
+
+	const std::shared_ptr<object::Task>& getTask() const noexcept
 	{
-		return std::make_shared<object::Task>(_task);
+		return _task;
 	}
 
 	const std::optional<std::string>& getClientMutationId() const noexcept
@@ -432,22 +1608,25 @@ public:
 	}
 
 private:
-	std::shared_ptr<Task> _task;
+	std::shared_ptr<object::Task> _task;
+	Eventual<std::shared_ptr<const TaskVersion>> _written;
 	std::optional<std::string> _clientMutationId;
 };
 
 class Mutation
 {
 public:
-	using completeTaskMutation =
-		std::function<std::shared_ptr<CompleteTaskPayload>(CompleteTaskInput&&)>;
+	// The payload's written result resolves with the TaskVersion which published the update, the
+	// mutation waits for it and moves the TaskVersion in today::RequestState forward to it.
+	using completeTaskMutation = std::function<std::shared_ptr<CompleteTaskPayload>(
+		CompleteTaskInput&&, const std::shared_ptr<service::RequestState>&)>;
 
 	explicit Mutation(completeTaskMutation&& mutateCompleteTask);
 
 	static double getFloat() noexcept;
 
-	std::shared_ptr<object::CompleteTaskPayload> applyCompleteTask(
-		CompleteTaskInput&& input) noexcept;
+	service::AwaitableObject<std::shared_ptr<object::CompleteTaskPayload>> applyCompleteTask(
+		service::FieldParams params, CompleteTaskInput input);
 	double applySetFloat(double valueArg) noexcept;
 
 private:
@@ -4,8 +4,8 @@ const { app, ipcMain } = require("electron");
 const graphql = require("bindings")("electron-cppgraphql.node");
 let serviceStarted = false;
 
-function startService() {
-  graphql.startService();
+function startService(options) {
+  graphql.startService(options);
   serviceStarted = true;
 }
 
@@ -16,7 +16,7 @@ function stopService() {
 
 exports.startGraphQL = function() {
   // Register the IPC callbacks
-  ipcMain.handle("startService", startService);
+  ipcMain.handle("startService", (_event, options) => startService(options));
   ipcMain.handle("stopService", stopService);
   ipcMain.handle("parseQuery", (_event, query) => graphql.parseQuery(query));
   ipcMain.handle("discardQuery", (_event, queryId) =>
@@ -18,7 +18,7 @@ ipcRenderer.on("completed", (_event, queryId) => {
 });
 
 contextBridge.exposeInMainWorld("graphql", {
-  startService: () => ipcRenderer.invoke("startService"),
+  startService: (options) => ipcRenderer.invoke("startService", options),
   stopService: () => ipcRenderer.invoke("stopService"),
   parseQuery: (query) => ipcRenderer.invoke("parseQuery", query),
   discardQuery: (queryId) => ipcRenderer.invoke("discardQuery", queryId),
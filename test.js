@@ -1,6 +1,29 @@
 describe("GraphQL native module tests", () => {
   const graphql = require("bindings")("electron-cppgraphql.node");
 
+  // Parses, fetches and discards a query, resolving to its single payload.
+  const fetchOnce = (query, variables = "") => {
+    const id = graphql.parseQuery(query);
+    return new Promise((resolve) => {
+      let result = null;
+      graphql.fetchQuery(
+        id,
+        "",
+        variables,
+        (payload) => {
+          result = JSON.parse(payload);
+        },
+        () => {
+          resolve(result);
+        }
+      );
+    }).then((result) => {
+      graphql.unsubscribe(id);
+      graphql.discardQuery(id);
+      return result;
+    });
+  };
+
   it("starts the service", () => {
     expect(graphql).not.toBeNull();
     graphql.startService();
@@ -56,6 +79,135 @@ describe("GraphQL native module tests", () => {
     queryId = null;
   });
 
+  let staleCursor = null;
+
+  it("round-trips edge cursors", async () => {
+    const edges = await fetchOnce(`query {
+        appointments {
+            edges {
+                cursor
+                node {
+                    id
+                }
+            }
+        }
+    }`);
+    const { cursor, node } = edges.data.appointments.edges[0];
+    const page = await fetchOnce(
+      `query ($after: ItemCursor) {
+        appointments(after: $after) {
+            edges {
+                node {
+                    id
+                }
+            }
+        }
+    }`,
+      JSON.stringify({ after: cursor })
+    );
+    expect(page.data.appointments.edges).toEqual([{ node }]);
+    staleCursor = cursor;
+  });
+
+  it("accepts a raw ID as a cursor", async () => {
+    const page = await fetchOnce(`query {
+        appointments(after: "ZmFrZUFwcG9pbnRtZW50SWQ=") {
+            edges {
+                node {
+                    id
+                }
+            }
+        }
+    }`);
+    expect(page.data.appointments.edges).toEqual([
+      { node: { id: "ZmFrZUFwcG9pbnRtZW50SWQ=" } },
+    ]);
+  });
+
+  it("rejects a cursor for a missing node", async () => {
+    const page = await fetchOnce(`query {
+        appointments(after: "bWlzc2luZ0lk") {
+            edges {
+                cursor
+            }
+        }
+    }`);
+    expect(page.errors[0].message).toMatch(/after cursor not found/);
+  });
+
+  it("rejects a cursor from another collection", async () => {
+    const tasks = await fetchOnce(`query {
+        tasks {
+            edges {
+                cursor
+            }
+        }
+    }`);
+    const page = await fetchOnce(
+      `query ($after: ItemCursor) {
+        appointments(after: $after) {
+            edges {
+                cursor
+            }
+        }
+    }`,
+      JSON.stringify({ after: tasks.data.tasks.edges[0].cursor })
+    );
+    expect(page.errors[0].message).toMatch(/after cursor not found/);
+  });
+
+  it("keeps cursors when a query selects more fields", async () => {
+    const cursorsOnly = await fetchOnce(`query {
+        appointments {
+            edges {
+                cursor
+            }
+        }
+    }`);
+    const withNodes = await fetchOnce(`query {
+        appointments {
+            edges {
+                cursor
+                node {
+                    subject
+                }
+            }
+        }
+    }`);
+    expect(withNodes.data.appointments.edges[0].node.subject).toEqual("Lunch?");
+    expect(withNodes.data.appointments.edges[0].cursor).toEqual(
+      cursorsOnly.data.appointments.edges[0].cursor
+    );
+  });
+
+  it("probes past either end of a page", async () => {
+    const result = await fetchOnce(`query {
+        whole: appointments(first: 1) {
+            pageInfo {
+                hasNextPage
+                hasPreviousPage
+            }
+        }
+        head: appointments(first: 0) {
+            pageInfo {
+                hasNextPage
+                hasPreviousPage
+            }
+        }
+        tail: appointments(last: 0) {
+            pageInfo {
+                hasNextPage
+                hasPreviousPage
+            }
+        }
+    }`);
+    expect(result.data).toEqual({
+      whole: { pageInfo: { hasNextPage: false, hasPreviousPage: false } },
+      head: { pageInfo: { hasNextPage: true, hasPreviousPage: false } },
+      tail: { pageInfo: { hasNextPage: false, hasPreviousPage: true } },
+    });
+  });
+
   let subscriptionId = null;
 
   it("parses subscription", () => {
@@ -141,9 +293,9 @@ describe("GraphQL native module tests", () => {
     mutationId = null;
   });
 
-  it("updates subscriptions", () => {
+  it("updates subscriptions", async () => {
     expect(subscriptionPromise).not.toBeNull();
-    expect(subscriptionPromise).resolves.toMatchSnapshot();
+    return expect(subscriptionPromise).resolves.toMatchSnapshot();
   });
 
   it("cleans up after the subscription", async () => {
@@ -157,7 +309,521 @@ describe("GraphQL native module tests", () => {
     subscriptionId = null;
   });
 
+  // Registers a subscription, next() resolves to each of its payloads in turn.
+  const subscribe = (query) => {
+    const id = graphql.parseQuery(query);
+    const payloads = [];
+    const waiting = [];
+    let resolveCompleted = null;
+    const completed = new Promise((resolve) => {
+      resolveCompleted = resolve;
+    });
+    graphql.fetchQuery(
+      id,
+      "",
+      "",
+      (payload) => {
+        const result = JSON.parse(payload);
+        const resolve = waiting.shift();
+        if (resolve) {
+          resolve(result);
+        } else {
+          payloads.push(result);
+        }
+      },
+      () => {
+        resolveCompleted();
+      }
+    );
+    return {
+      next: () =>
+        payloads.length > 0
+          ? Promise.resolve(payloads.shift())
+          : new Promise((resolve) => {
+              waiting.push(resolve);
+            }),
+      pending: () => payloads.length,
+      completed,
+      unsubscribe: async () => {
+        graphql.unsubscribe(id);
+        await completed;
+        graphql.discardQuery(id);
+      },
+    };
+  };
+
+  const completeTask = (isComplete) =>
+    fetchOnce(`mutation {
+        completeTask(input: {id: "ZmFrZVRhc2tJZA==", isComplete: ${isComplete}}) {
+            clientMutationId
+        }
+    }`);
+
+  it("routes changes only to subscriptions on the changed node", async () => {
+    const task = subscribe(`subscription {
+        nodeChange(id: "ZmFrZVRhc2tJZA==") {
+            id
+        }
+    }`);
+    const appointment = subscribe(`subscription {
+        nodeChange(id: "ZmFrZUFwcG9pbnRtZW50SWQ=") {
+            id
+        }
+    }`);
+    await completeTask(false);
+    await expect(task.next()).resolves.toEqual({
+      data: { nodeChange: { id: "ZmFrZVRhc2tJZA==" } },
+    });
+    expect(appointment.pending()).toEqual(0);
+    await task.unsubscribe();
+    await appointment.unsubscribe();
+  });
+
+  it("shares a subscription between identical documents", async () => {
+    const document = `subscription {
+        nodeChange(id: "ZmFrZVRhc2tJZA==") {
+            ...on Task {
+                isComplete
+            }
+        }
+    }`;
+    const first = subscribe(document);
+    const second = subscribe(document);
+    await completeTask(true);
+    const completed = { data: { nodeChange: { isComplete: true } } };
+    await expect(first.next()).resolves.toEqual(completed);
+    await expect(second.next()).resolves.toEqual(completed);
+
+    // The other sink keeps receiving after one of them unsubscribes.
+    await first.unsubscribe();
+    await completeTask(false);
+    await expect(second.next()).resolves.toEqual({
+      data: { nodeChange: { isComplete: false } },
+    });
+    await second.unsubscribe();
+  });
+
+  it("delivers the state of each change in order", async () => {
+    const task = subscribe(`subscription {
+        nodeChange(id: "ZmFrZVRhc2tJZA==") {
+            ...on Task {
+                isComplete
+            }
+        }
+    }`);
+    await Promise.all([completeTask(false), completeTask(true)]);
+    await expect(task.next()).resolves.toEqual({
+      data: { nodeChange: { isComplete: false } },
+    });
+    await expect(task.next()).resolves.toEqual({
+      data: { nodeChange: { isComplete: true } },
+    });
+    await task.unsubscribe();
+  });
+
+  it("drops subscriptions when the service restarts without stopping", async () => {
+    const document = `subscription {
+        nodeChange(id: "ZmFrZVRhc2tJZA==") {
+            ...on Task {
+                isComplete
+            }
+        }
+    }`;
+    const before = subscribe(document);
+    graphql.startService();
+    await before.completed;
+
+    // The identical document must subscribe to the new service, not join the old one.
+    const after = subscribe(document);
+    await completeTask(true);
+    await expect(after.next()).resolves.toEqual({
+      data: { nodeChange: { isComplete: true } },
+    });
+    expect(before.pending()).toEqual(0);
+    await after.unsubscribe();
+  });
+
   it("stops the service", () => {
     graphql.stopService();
   });
+
+  it("restarts the service with global IDs", () => {
+    graphql.startService({ globalIds: true, requestStats: true });
+  });
+
+  it("resolves node(id:) from a global ID", async () => {
+    const result = await fetchOnce(`query {
+        appointment: node(id: "/gFmYWtlQXBwb2ludG1lbnRJZA==") {
+            id
+            ...on Appointment {
+                subject
+            }
+        }
+        task: node(id: "/gJmYWtlVGFza0lk") {
+            id
+            ...on Task {
+                title
+            }
+        }
+        folder: node(id: "/gNmYWtlRm9sZGVySWQ=") {
+            id
+            ...on Folder {
+                name
+            }
+        }
+    }`);
+    expect(result.data).toEqual({
+      appointment: { id: "/gFmYWtlQXBwb2ludG1lbnRJZA==", subject: "Lunch?" },
+      task: { id: "/gJmYWtlVGFza0lk", title: "Don't forget" },
+      folder: { id: "/gNmYWtlRm9sZGVySWQ=", name: '"Fake" Inbox' },
+    });
+    expect(result.extensions).toEqual({
+      fetchEntities: 1,
+      loadAppointments: 1,
+      loadTasks: 1,
+      loadUnreadCounts: 1,
+    });
+  });
+
+  it("only probes the collection named in a global ID", async () => {
+    const result = await fetchOnce(`query {
+        node(id: "/gJmYWtlQXBwb2ludG1lbnRJZA==") {
+            id
+        }
+    }`);
+    expect(result.data).toEqual({ node: null });
+  });
+
+  it("resolves appointmentsById with global IDs", async () => {
+    const result = await fetchOnce(`query {
+        appointmentsById(ids: ["/gFmYWtlQXBwb2ludG1lbnRJZA=="]) {
+            id
+            subject
+        }
+    }`);
+    expect(result.data).toEqual({
+      appointmentsById: [{ id: "/gFmYWtlQXBwb2ludG1lbnRJZA==", subject: "Lunch?" }],
+    });
+  });
+
+  it("falls back to the ID for a cursor from an older snapshot", async () => {
+    expect(staleCursor).not.toBeNull();
+    const page = await fetchOnce(
+      `query ($after: ItemCursor) {
+        appointments(after: $after) {
+            edges {
+                node {
+                    id
+                }
+            }
+        }
+    }`,
+      JSON.stringify({ after: staleCursor })
+    );
+    expect(page.data.appointments.edges).toEqual([
+      { node: { id: "/gFmYWtlQXBwb2ludG1lbnRJZA==" } },
+    ]);
+  });
+
+  it("batches node(id:) and *ById lookups in one request", async () => {
+    const result = await fetchOnce(`query {
+        node(id: "/gJmYWtlVGFza0lk") {
+            id
+        }
+        tasksById(ids: ["/gJmYWtlVGFza0lk", "/gJtaXNzaW5nVGFza0lk", "/gJmYWtlVGFza0lk"]) {
+            id
+        }
+        unreadCountsById(ids: ["/gNmYWtlRm9sZGVySWQ="]) {
+            name
+        }
+    }`);
+    expect(result.data).toEqual({
+      node: { id: "/gJmYWtlVGFza0lk" },
+      tasksById: [{ id: "/gJmYWtlVGFza0lk" }, null, { id: "/gJmYWtlVGFza0lk" }],
+      unreadCountsById: [{ name: '"Fake" Inbox' }],
+    });
+    // Every lookup is fetched in one batch, and the collections are already loaded.
+    expect(result.extensions).toEqual({
+      fetchEntities: 1,
+      loadAppointments: 0,
+      loadTasks: 0,
+      loadUnreadCounts: 0,
+    });
+  });
+
+  it("stops the service with global IDs", () => {
+    graphql.stopService();
+  });
+
+  it("restarts the service with page loaders", () => {
+    graphql.startService({ pageLoaders: true });
+  });
+
+  it("round-trips cursors from the store's page loader", async () => {
+    const edges = await fetchOnce(`query {
+        appointments(first: 1) {
+            pageInfo {
+                hasNextPage
+                hasPreviousPage
+            }
+            edges {
+                cursor
+                node {
+                    id
+                    subject
+                }
+            }
+        }
+    }`);
+    expect(edges.data.appointments.pageInfo).toEqual({
+      hasNextPage: false,
+      hasPreviousPage: false,
+    });
+    const [{ cursor, node }] = edges.data.appointments.edges;
+    expect(node).toEqual({ id: "ZmFrZUFwcG9pbnRtZW50SWQ=", subject: "Lunch?" });
+    const page = await fetchOnce(
+      `query ($after: ItemCursor) {
+        appointments(after: $after) {
+            edges {
+                cursor
+                node {
+                    id
+                }
+            }
+        }
+    }`,
+      JSON.stringify({ after: cursor })
+    );
+    expect(page.data.appointments.edges).toEqual([{ cursor, node: { id: node.id } }]);
+  });
+
+  it("probes past either end of a store page without the edges", async () => {
+    const result = await fetchOnce(`query {
+        head: tasks(first: 0) {
+            pageInfo {
+                hasNextPage
+                hasPreviousPage
+            }
+        }
+        tail: tasks(last: 0) {
+            pageInfo {
+                hasNextPage
+                hasPreviousPage
+            }
+        }
+    }`);
+    expect(result.data).toEqual({
+      head: { pageInfo: { hasNextPage: true, hasPreviousPage: false } },
+      tail: { pageInfo: { hasNextPage: false, hasPreviousPage: true } },
+    });
+  });
+
+  it("rejects cursors the store's page loader can't find", async () => {
+    const tasks = await fetchOnce(`query {
+        tasks {
+            edges {
+                cursor
+            }
+        }
+    }`);
+    const wrongCollection = await fetchOnce(
+      `query ($after: ItemCursor) {
+        appointments(after: $after) {
+            edges {
+                cursor
+            }
+        }
+    }`,
+      JSON.stringify({ after: tasks.data.tasks.edges[0].cursor })
+    );
+    expect(wrongCollection.errors[0].message).toMatch(/after cursor not found/);
+    const missingNode = await fetchOnce(`query {
+        unreadCounts(before: "bWlzc2luZ0lk") {
+            edges {
+                cursor
+            }
+        }
+    }`);
+    expect(missingNode.errors[0].message).toMatch(/before cursor not found/);
+  });
+
+  it("stops the service with page loaders", () => {
+    graphql.stopService();
+  });
+
+  const fs = require("fs");
+  const os = require("os");
+  const path = require("path");
+  const dataset = path.join(os.tmpdir(), `electron-cppgraphql-${process.pid}.dataset`);
+
+  const removeDataset = () => {
+    for (const file of [dataset, `${dataset}.journal`, `${dataset}.journal.rotated`]) {
+      fs.rmSync(file, { force: true });
+    }
+  };
+
+  const fetchTask = () =>
+    fetchOnce(`query {
+        tasksById(ids: ["ZmFrZVRhc2tJZA=="]) {
+            title
+            isComplete
+        }
+    }`);
+
+  it("writes a new dataset", async () => {
+    removeDataset();
+    graphql.startService({ dataset });
+    expect(fs.existsSync(dataset)).toEqual(true);
+    expect((await fetchTask()).data).toEqual({
+      tasksById: [{ title: "Don't forget", isComplete: true }],
+    });
+    graphql.stopService();
+  });
+
+  it("maps an existing dataset", async () => {
+    graphql.startService({ dataset });
+    expect((await fetchTask()).data).toEqual({
+      tasksById: [{ title: "Don't forget", isComplete: true }],
+    });
+    graphql.stopService();
+  });
+
+  // Each section extent in the header is a 64-bit offset and count, after the magic and version.
+  const sectionOffset = (bytes, section) => Number(bytes.readBigUInt64LE(8 + 16 * section));
+  const taskTitleSection = 9;
+  const taskStatesSection = 11;
+  const taskIdOrderSection = 17;
+
+  const withCorrupted = async (corrupt, test) => {
+    const corrupted = `${dataset}.corrupt`;
+    const bytes = fs.readFileSync(dataset);
+    corrupt(bytes);
+    fs.writeFileSync(corrupted, bytes);
+    try {
+      await test(corrupted);
+    } finally {
+      for (const file of [corrupted, `${corrupted}.journal`, `${corrupted}.journal.rotated`]) {
+        fs.rmSync(file, { force: true });
+      }
+    }
+  };
+
+  it("rejects a dataset with a corrupt header", () =>
+    withCorrupted(
+      (bytes) => bytes.writeUInt32LE(0, 0),
+      (corrupted) => {
+        expect(() => graphql.startService({ dataset: corrupted })).toThrow(
+          /Unsupported dataset version/
+        );
+      }
+    ));
+
+  // The rows are only checked as they're read, so a corrupt row doesn't stop the service.
+  it("reports a corrupt string index when it's read", () =>
+    withCorrupted(
+      (bytes) => bytes.writeUInt32LE(0xffffffff, sectionOffset(bytes, taskTitleSection)),
+      async (corrupted) => {
+        graphql.startService({ dataset: corrupted });
+        try {
+          const result = await fetchTask();
+          expect(result.errors[0].message).toMatch(/Invalid dataset string index/);
+        } finally {
+          graphql.stopService();
+        }
+      }
+    ));
+
+  it("reports a corrupt task state when it's updated", () =>
+    withCorrupted(
+      (bytes) => bytes.writeUInt8(99, sectionOffset(bytes, taskStatesSection)),
+      async (corrupted) => {
+        graphql.startService({ dataset: corrupted });
+        try {
+          const result = await completeTask(false);
+          expect(result.errors[0].message).toMatch(/Invalid dataset task state/);
+        } finally {
+          graphql.stopService();
+        }
+      }
+    ));
+
+  it("finds nothing through a corrupt ID index", () =>
+    withCorrupted(
+      (bytes) => bytes.writeUInt32LE(0xffffffff, sectionOffset(bytes, taskIdOrderSection)),
+      async (corrupted) => {
+        graphql.startService({ dataset: corrupted });
+        try {
+          expect((await fetchTask()).data).toEqual({ tasksById: [null] });
+        } finally {
+          graphql.stopService();
+        }
+      }
+    ));
+
+  it("replays the journal after a restart", async () => {
+    graphql.startService({ dataset });
+    const result = await fetchOnce(`mutation {
+        completeTask(input: {id: "ZmFrZVRhc2tJZA==", isComplete: false}) {
+            task {
+                isComplete
+            }
+        }
+    }`);
+    expect(result.data).toEqual({ completeTask: { task: { isComplete: false } } });
+    graphql.stopService();
+
+    graphql.startService({ dataset });
+    expect((await fetchTask()).data).toEqual({
+      tasksById: [{ title: "Don't forget", isComplete: false }],
+    });
+    graphql.stopService();
+  });
+
+  it("compacts the journal into the dataset", async () => {
+    graphql.startService({ dataset, compactAfter: 1 });
+    await completeTask(true);
+
+    // Stopping waits for the compaction to finish.
+    graphql.stopService();
+    expect(fs.existsSync(`${dataset}.journal.rotated`)).toEqual(false);
+    expect(fs.statSync(`${dataset}.journal`).size).toEqual(0);
+
+    graphql.startService({ dataset });
+    expect((await fetchTask()).data).toEqual({
+      tasksById: [{ title: "Don't forget", isComplete: true }],
+    });
+    graphql.stopService();
+  });
+
+  it("rejects a journal with an invalid task state", () => {
+    const journal = `${dataset}.journal`;
+    const saved = fs.existsSync(journal) ? fs.readFileSync(journal) : Buffer.alloc(0);
+    const taskId = Buffer.from("fakeTaskId");
+    const record = Buffer.alloc(4 + 3 + taskId.length);
+    record.writeUInt32LE(3 + taskId.length, 0);
+    record.writeUInt8(0x2, 4);
+    record.writeUInt8(99, 6);
+    taskId.copy(record, 7);
+    fs.writeFileSync(journal, Buffer.concat([saved, record]));
+    try {
+      expect(() => graphql.startService({ dataset })).toThrow(/Invalid journal task state/);
+    } finally {
+      fs.writeFileSync(journal, saved);
+    }
+  });
+
+  it("rejects completeTask for an unknown task", async () => {
+    graphql.startService({ dataset });
+    const result = await fetchOnce(`mutation {
+        completeTask(input: {id: "bWlzc2luZ0lk", isComplete: true}) {
+            clientMutationId
+        }
+    }`);
+    expect(result.errors[0].message).toMatch(/task not found/);
+    graphql.stopService();
+  });
+
+  it("removes the dataset", () => {
+    removeDataset();
+  });
 });